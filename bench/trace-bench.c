@@ -0,0 +1,511 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Synthetic workloads to measure the cost of ingesting events into a
+ * traceeval table and of sorting and reading back the results.
+ *
+ * Every workload runs in its own child process so that the peak RSS it
+ * reports is its own. The output is one CSV row per workload, so that
+ * runs from different commits can be compared with standard tools.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <traceeval.h>
+
+#define DEFAULT_EVENTS		1000000
+#define DEFAULT_CARDS		"100,10000,100000"
+/* The whole range, selected with "-c full" */
+#define FULL_CARDS		"100,10000,100000,1000000,10000000"
+#define DEFAULT_SHAPES		"1num,2num,4num,1str,2mix"
+#define DEFAULT_DISTS		"uniform,zipf"
+#define DEFAULT_MODES		"pair,window"
+#define DEFAULT_SEED		0x5eed
+#define DEFAULT_THETA		0.99
+#define WINDOW			64
+
+enum key_shape {
+	SHAPE_1NUM,
+	SHAPE_2NUM,
+	SHAPE_4NUM,
+	SHAPE_1STR,
+	SHAPE_2MIX,
+};
+
+enum dist {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+};
+
+enum mode {
+	/* start and stop of the same key back to back */
+	MODE_PAIR,
+	/* WINDOW intervals in flight, stopped in the order they started */
+	MODE_WINDOW,
+};
+
+static const char *shape_names[] = { "1num", "2num", "4num", "1str", "2mix" };
+static const char *dist_names[] = { "uniform", "zipf" };
+static const char *mode_names[] = { "pair", "window" };
+
+struct workload {
+	enum key_shape		shape;
+	enum dist		dist;
+	enum mode		mode;
+	size_t			cardinality;
+	size_t			nr_events;
+	unsigned long long	seed;
+	double			theta;
+};
+
+static const char *label;
+
+static unsigned long long rand_next(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	/* xorshift64* */
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double rand_double(unsigned long long *state)
+{
+	return (rand_next(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static unsigned int *make_ids(struct workload *wl)
+{
+	unsigned long long state = wl->seed;
+	unsigned int *ids;
+	double *cdf = NULL;
+	double sum = 0;
+	size_t i;
+
+	ids = malloc(sizeof(*ids) * wl->nr_events);
+	if (!ids)
+		die("malloc ids");
+
+	if (wl->dist == DIST_ZIPF) {
+		cdf = malloc(sizeof(*cdf) * wl->cardinality);
+		if (!cdf)
+			die("malloc cdf");
+
+		for (i = 0; i < wl->cardinality; i++) {
+			sum += 1.0 / pow(i + 1, wl->theta);
+			cdf[i] = sum;
+		}
+	}
+
+	for (i = 0; i < wl->nr_events; i++) {
+		size_t lo, hi, mid;
+		double r;
+
+		if (!cdf) {
+			ids[i] = rand_next(&state) % wl->cardinality;
+			continue;
+		}
+
+		r = rand_double(&state) * sum;
+		lo = 0;
+		hi = wl->cardinality - 1;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (cdf[mid] < r)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		/* Scatter the popular ids over the key space */
+		ids[i] = (lo * 2654435761ULL) % wl->cardinality;
+	}
+
+	free(cdf);
+	return ids;
+}
+
+static struct traceeval *make_table(struct workload *wl, int *nr_keys)
+{
+	struct traceeval_key_info_array *iarray;
+	struct traceeval_key_info kinfo[4];
+	struct traceeval *teval;
+	int i;
+
+	memset(kinfo, 0, sizeof(kinfo));
+
+	switch (wl->shape) {
+	case SHAPE_1NUM:
+		*nr_keys = 1;
+		kinfo[0].type = TRACEEVAL_TYPE_NUMBER;
+		break;
+	case SHAPE_2NUM:
+		*nr_keys = 2;
+		kinfo[0].type = TRACEEVAL_TYPE_NUMBER;
+		kinfo[1].type = TRACEEVAL_TYPE_NUMBER_32;
+		break;
+	case SHAPE_4NUM:
+		*nr_keys = 4;
+		kinfo[0].type = TRACEEVAL_TYPE_NUMBER;
+		kinfo[1].type = TRACEEVAL_TYPE_NUMBER_32;
+		kinfo[2].type = TRACEEVAL_TYPE_NUMBER_16;
+		kinfo[3].type = TRACEEVAL_TYPE_NUMBER_8;
+		break;
+	case SHAPE_1STR:
+		*nr_keys = 1;
+		kinfo[0].type = TRACEEVAL_TYPE_STRING;
+		break;
+	case SHAPE_2MIX:
+		*nr_keys = 2;
+		kinfo[0].type = TRACEEVAL_TYPE_NUMBER;
+		kinfo[1].type = TRACEEVAL_TYPE_STRING;
+		break;
+	default:
+		die("unknown key shape");
+	}
+
+	iarray = traceeval_key_info_array_alloc();
+	if (!iarray)
+		die("traceeval_key_info_array_alloc");
+
+	for (i = 0; i < *nr_keys; i++) {
+		kinfo[i].name = "key";
+		if (traceeval_key_info_array_add(iarray, &kinfo[i]) < 0)
+			die("traceeval_key_info_array_add");
+	}
+
+	teval = traceeval_n_alloc("bench", iarray);
+	traceeval_key_info_array_free(iarray);
+	if (!teval)
+		die("traceeval_n_alloc");
+
+	return teval;
+}
+
+static char **make_strings(size_t cardinality)
+{
+	char **strings;
+	size_t i;
+
+	strings = malloc(sizeof(*strings) * cardinality);
+	if (!strings)
+		die("malloc strings");
+
+	for (i = 0; i < cardinality; i++) {
+		if (asprintf(&strings[i], "task-%zu", i) < 0)
+			die("asprintf");
+	}
+	return strings;
+}
+
+/* Map a key id onto the keys of the table in use */
+static void fill_keys(struct workload *wl, char **strings, unsigned int id,
+		      struct traceeval_key *keys)
+{
+	switch (wl->shape) {
+	case SHAPE_1NUM:
+		keys[0].type = TRACEEVAL_TYPE_NUMBER;
+		keys[0].number = id;
+		break;
+	case SHAPE_2NUM:
+		keys[0].type = TRACEEVAL_TYPE_NUMBER;
+		keys[0].number = id >> 6;
+		keys[1].type = TRACEEVAL_TYPE_NUMBER_32;
+		keys[1].number_32 = id & 63;
+		break;
+	case SHAPE_4NUM:
+		keys[0].type = TRACEEVAL_TYPE_NUMBER;
+		keys[0].number = id >> 12;
+		keys[1].type = TRACEEVAL_TYPE_NUMBER_32;
+		keys[1].number_32 = (id >> 8) & 15;
+		keys[2].type = TRACEEVAL_TYPE_NUMBER_16;
+		keys[2].number_16 = (id >> 4) & 15;
+		keys[3].type = TRACEEVAL_TYPE_NUMBER_8;
+		keys[3].number_8 = id & 15;
+		break;
+	case SHAPE_1STR:
+		keys[0].type = TRACEEVAL_TYPE_STRING;
+		keys[0].string = strings[id];
+		break;
+	case SHAPE_2MIX:
+		keys[0].type = TRACEEVAL_TYPE_NUMBER;
+		keys[0].number = id >> 6;
+		keys[1].type = TRACEEVAL_TYPE_STRING;
+		keys[1].string = strings[id & 63];
+		break;
+	}
+}
+
+static void run_workload(struct workload *wl)
+{
+	struct traceeval_key keys[4];
+	unsigned long long ingest, materialize, sort_totals, sort_cnt, sort_keys, walk;
+	unsigned long long start, ts = 1;
+	struct traceeval_stats stats;
+	struct traceeval *teval;
+	struct rusage usage;
+	char **strings = NULL;
+	unsigned int *ids;
+	ssize_t sum = 0;
+	int nr_keys;
+	size_t nr, i;
+
+	ids = make_ids(wl);
+	if (wl->shape == SHAPE_1STR || wl->shape == SHAPE_2MIX)
+		strings = make_strings(wl->cardinality);
+	teval = make_table(wl, &nr_keys);
+
+	start = now_ns();
+	for (i = 0; i < wl->nr_events; i++) {
+		switch (wl->mode) {
+		case MODE_PAIR:
+			fill_keys(wl, strings, ids[i], keys);
+			traceeval_n_start(teval, keys, ts++);
+			traceeval_n_stop(teval, keys, ts++);
+			break;
+		case MODE_WINDOW:
+			if (i >= WINDOW) {
+				fill_keys(wl, strings, ids[i - WINDOW], keys);
+				traceeval_n_stop(teval, keys, ts++);
+			}
+			fill_keys(wl, strings, ids[i], keys);
+			traceeval_n_start(teval, keys, ts++);
+			break;
+		}
+	}
+	ingest = now_ns() - start;
+
+	traceeval_get_stats(teval, &stats);
+
+	/* The first access to the results creates and sorts them */
+	start = now_ns();
+	sum += traceeval_result_indx_cnt(teval, 0);
+	materialize = now_ns() - start;
+
+	start = now_ns();
+	traceeval_sort_totals(teval, false);
+	sort_totals = now_ns() - start;
+
+	start = now_ns();
+	traceeval_sort_cnt(teval, false);
+	sort_cnt = now_ns() - start;
+
+	start = now_ns();
+	traceeval_sort_keys(teval, true);
+	sort_keys = now_ns() - start;
+
+	nr = traceeval_result_nr(teval);
+
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		traceeval_result_indx_key_array(teval, i);
+		sum += traceeval_result_indx_cnt(teval, i);
+		sum += traceeval_result_indx_total(teval, i);
+		sum += traceeval_result_indx_max(teval, i);
+		sum += traceeval_result_indx_min(teval, i);
+	}
+	walk = now_ns() - start;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("%s,%s,%s,%s,%zu,%zu,%zu,%.2f,%zu,%.2f,%llu,%llu,%llu,%llu,%llu,%ld,%zd\n",
+	       label, shape_names[wl->shape], dist_names[wl->dist],
+	       mode_names[wl->mode], wl->cardinality, wl->nr_events, nr,
+	       (double)ingest / wl->nr_events, stats.max_chain,
+	       stats.lookups ? (double)stats.probes / stats.lookups : 0,
+	       materialize, sort_totals,
+	       sort_cnt, sort_keys, walk, usage.ru_maxrss, sum);
+	fflush(stdout);
+
+	traceeval_free(teval);
+	if (strings) {
+		for (i = 0; i < wl->cardinality; i++)
+			free(strings[i]);
+		free(strings);
+	}
+	free(ids);
+}
+
+static int lookup(const char *name, const char **names, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	}
+	fprintf(stderr, "Unknown option value '%s'\n", name);
+	exit(-1);
+}
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Parse a comma separated list into @vals, returns the number parsed */
+static int parse_list(const char *arg, const char **names, int nr_names,
+		      size_t *vals, int max)
+{
+	char *str, *tok, *save;
+	int nr = 0;
+
+	str = strdup(arg);
+	if (!str)
+		die("strdup");
+
+	for (tok = strtok_r(str, ",", &save); tok && nr < max;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (names)
+			vals[nr++] = lookup(tok, names, nr_names);
+		else
+			vals[nr++] = strtoull(tok, NULL, 0);
+	}
+	free(str);
+	return nr;
+}
+
+static void usage(const char *prog, int status)
+{
+	fprintf(status ? stderr : stdout, "usage: %s [options]\n"
+	       "  -n events       events per workload (default %d)\n"
+	       "  -c list         key cardinalities (default %s),\n"
+	       "                  or \"full\" for %s\n"
+	       "  -k list         key shapes: 1num,2num,4num,1str,2mix (default all)\n"
+	       "  -d list         distributions: uniform,zipf (default both)\n"
+	       "  -m list         start/stop interleaving: pair,window (default both)\n"
+	       "  -z theta        zipf exponent (default %.2f)\n"
+	       "  -s seed         random seed (default %#x)\n"
+	       "  -l label        label for the first column (default \"local\")\n"
+	       "  -H              do not print the CSV header\n"
+	       "  -h              show this help\n",
+	       prog, DEFAULT_EVENTS, DEFAULT_CARDS, FULL_CARDS, DEFAULT_THETA,
+	       DEFAULT_SEED);
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	size_t cards[32], shapes[ARRAY_SIZE(shape_names)];
+	size_t dists[ARRAY_SIZE(dist_names)], modes[ARRAY_SIZE(mode_names)];
+	int nr_cards, nr_shapes, nr_dists, nr_modes;
+	struct workload wl = {
+		.nr_events	= DEFAULT_EVENTS,
+		.seed		= DEFAULT_SEED,
+		.theta		= DEFAULT_THETA,
+	};
+	bool header = true;
+	int c, s, d, m, status;
+	pid_t pid;
+
+	label = "local";
+	nr_cards = parse_list(DEFAULT_CARDS, NULL, 0, cards, ARRAY_SIZE(cards));
+	nr_shapes = parse_list(DEFAULT_SHAPES, shape_names, ARRAY_SIZE(shape_names),
+			       shapes, ARRAY_SIZE(shapes));
+	nr_dists = parse_list(DEFAULT_DISTS, dist_names, ARRAY_SIZE(dist_names),
+			      dists, ARRAY_SIZE(dists));
+	nr_modes = parse_list(DEFAULT_MODES, mode_names, ARRAY_SIZE(mode_names),
+			      modes, ARRAY_SIZE(modes));
+
+	while ((c = getopt(argc, argv, "n:c:k:d:m:z:s:l:Hh")) >= 0) {
+		switch (c) {
+		case 'n':
+			wl.nr_events = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			if (strcmp(optarg, "full") == 0)
+				optarg = FULL_CARDS;
+			nr_cards = parse_list(optarg, NULL, 0, cards, ARRAY_SIZE(cards));
+			break;
+		case 'k':
+			nr_shapes = parse_list(optarg, shape_names, ARRAY_SIZE(shape_names),
+					       shapes, ARRAY_SIZE(shapes));
+			break;
+		case 'd':
+			nr_dists = parse_list(optarg, dist_names, ARRAY_SIZE(dist_names),
+					      dists, ARRAY_SIZE(dists));
+			break;
+		case 'm':
+			nr_modes = parse_list(optarg, mode_names, ARRAY_SIZE(mode_names),
+					      modes, ARRAY_SIZE(modes));
+			break;
+		case 'z':
+			wl.theta = strtod(optarg, NULL);
+			break;
+		case 's':
+			wl.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'H':
+			header = false;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], -1);
+		}
+	}
+
+	if (!wl.nr_events || !wl.seed)
+		usage(argv[0], -1);
+
+	if (header)
+		printf("label,keys,dist,mode,cardinality,events,entries,ns_per_event,"
+		       "max_chain,probes_per_lookup,"
+		       "materialize_ns,sort_totals_ns,sort_cnt_ns,sort_keys_ns,"
+		       "walk_ns,peak_rss_kb,checksum\n");
+	fflush(stdout);
+
+	for (c = 0; c < nr_cards; c++) {
+		for (s = 0; s < nr_shapes; s++) {
+			for (d = 0; d < nr_dists; d++) {
+				for (m = 0; m < nr_modes; m++) {
+					wl.cardinality = cards[c];
+					wl.shape = shapes[s];
+					wl.dist = dists[d];
+					wl.mode = modes[m];
+
+					if (!wl.cardinality)
+						continue;
+
+					pid = fork();
+					if (pid < 0)
+						die("fork");
+					if (!pid) {
+						run_workload(&wl);
+						exit(0);
+					}
+					if (waitpid(pid, &status, 0) < 0 ||
+					    !WIFEXITED(status) || WEXITSTATUS(status))
+						fprintf(stderr, "workload %s/%s/%s/%zu failed\n",
+							shape_names[wl.shape],
+							dist_names[wl.dist],
+							mode_names[wl.mode],
+							wl.cardinality);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
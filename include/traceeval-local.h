@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Copyright (C) 2022 Google Inc, Steven Rostedt <rostedt@goodmis.org>
+ */
+#ifndef __LIBTRACEEVAL_LOCAL_H__
+#define __LIBTRACEEVAL_LOCAL_H__
+
+#include "traceeval.h"
+
+#define HASH_BITS 10
+#define HASH_SIZE (1 << HASH_BITS)
+#define HASH_MASK (HASH_SIZE - 1)
+
+/* Outer starts of nested intervals kept in the metric before spilling */
+#define NEST_INLINE		2
+
+enum sort_type {
+	NONE,
+	KEYS,
+	TOTALS,
+	MAX,
+	MIN,
+	CNT,
+};
+
+struct eval_counters {
+	unsigned long long	lookups;
+	unsigned long long	misses;
+	unsigned long long	probes;
+	unsigned long long	inserts;
+	unsigned long long	nr_sorts;
+	unsigned long long	sort_ns;
+};
+
+struct traceeval_key_info_array {
+	size_t				nr_keys;
+	struct traceeval_key_info	*keys;
+};
+
+struct eval_metric {
+	unsigned long long	total;
+	unsigned long long	last;
+	unsigned long long	max;
+	unsigned long long	min;
+	unsigned long long	cnt;
+	bool			started;
+	/* Number of outer starts saved by traceeval_n_start_nested() */
+	unsigned int		depth;
+	unsigned int		spill_size;
+	unsigned long long	nest[NEST_INLINE];
+	unsigned long long	*spill;
+};
+
+struct eval_instance {
+	size_t			nr_keys;
+	struct traceeval_key	*keys;
+	void			*private;
+	size_t			nr_metrics;
+	struct eval_metric	*metrics;
+};
+
+struct eval_hash {
+	struct eval_hash		*next;
+	struct eval_hash		*dirty_next;
+	bool				dirty;
+	/* The epoch in which started intervals were carried into it */
+	unsigned int			epoch;
+	struct eval_instance		eval;
+	struct eval_metric		metrics[];
+};
+
+/* All the instances that share the same first nr_keys keys */
+struct eval_index_entry {
+	struct eval_index_entry		*next;
+	size_t				nr_evals;
+	size_t				size;
+	struct eval_instance		**evals;
+	struct traceeval_key		keys[];
+};
+
+struct eval_index {
+	struct traceeval_key_info_array	array;
+	struct eval_index_entry		*hash[HASH_SIZE];
+};
+
+struct traceeval {
+	struct traceeval_key_info_array		array;
+	struct eval_instance			*evals;
+	struct eval_hash			*eval_hash[HASH_SIZE];
+	size_t					nr_evals;
+	struct eval_index			**indexes;
+	size_t					nr_indexes;
+	struct eval_hash			*dirty;
+	size_t					nr_dirty;
+	struct eval_instance			*results;
+	enum sort_type				sort_type;
+	int					sort_metric;
+	bool					sort_ascending;
+	size_t					nr_metrics;
+	char					**metric_names;
+	int					users;
+	struct eval_counters			counters;
+	int					sort_threads;
+	size_t					sort_threshold;
+	/* Instances keep their own copy of string keys */
+	bool					copy_strings;
+	/* The table of the previous epoch, holding intervals still started */
+	struct traceeval			*carry;
+	unsigned int				epoch;
+};
+
+struct traceeval *trace_eval_alloc_like(struct traceeval *teval);
+int trace_eval_get_results(struct traceeval *teval);
+int trace_eval_hash(struct traceeval *teval, const struct traceeval_key *keys);
+
+int trace_eval_threads(int nr_threads);
+void trace_eval_sort(void *base, size_t nmemb, size_t size,
+		     int (*cmp)(const void *, const void *, void *), void *arg,
+		     int nr_threads);
+
+#endif /* __LIBTRACEEVAL_LOCAL_H__ */
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Copyright (C) 2022 Google Inc, Steven Rostedt <rostedt@goodmis.org>
+ */
+#ifndef __LIBTRACEEVAL_TRACECMD_H__
+#define __LIBTRACEEVAL_TRACECMD_H__
+
+#include <traceeval.h>
+#include <trace-cmd.h>
+
+struct traceeval_tracecmd_events;
+
+enum traceeval_tracecmd_op {
+	TRACEEVAL_TRACECMD_START,
+	TRACEEVAL_TRACECMD_STOP,
+	TRACEEVAL_TRACECMD_CONTINUE,
+	TRACEEVAL_TRACECMD_START_NESTED,
+};
+
+typedef int (*traceeval_tracecmd_func)(struct traceeval_tracecmd_events *events,
+				       struct tep_handle *tep,
+				       struct tep_record *record,
+				       int cpu, void *data);
+
+int traceeval_tracecmd_add(struct traceeval_tracecmd_events *events,
+			   enum traceeval_tracecmd_op op,
+			   const struct traceeval_key *keys, int metric,
+			   unsigned long long ts);
+
+int traceeval_tracecmd_ingest(struct traceeval *teval, const char *file,
+			      traceeval_tracecmd_func func, void *data);
+
+#endif /* __LIBTRACEEVAL_TRACECMD_H__ */
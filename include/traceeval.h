@@ -15,6 +15,8 @@ struct traceeval;
 struct traceeval_key_array;
 struct traceeval_key_info_array;
 struct traceeval_outliers;
+struct traceeval_epoch;
+struct traceeval_export;
 
 enum traceeval_type {
 	TRACEEVAL_TYPE_NONE,
@@ -66,6 +68,8 @@ int traceeval_key_info_array_add(struct traceeval_key_info_array *iarray,
 			     unsigned long long stop);
 	int traceeval_n_continue(struct traceeval *teval, const struct traceeval_key *keys,
 				 unsigned long long start);
+	int traceeval_n_start_nested(struct traceeval *teval, const struct traceeval_key *keys,
+				     unsigned long long start);
 
 	int traceeval_n_set_private(struct traceeval *teval, const struct traceeval_key *keys,
 				    void *data);
@@ -101,15 +105,65 @@ int traceeval_1_stop(struct traceeval *teval, struct traceeval_key key,
 		     unsigned long long stop);
 int traceeval_1_continue(struct traceeval *teval, struct traceeval_key key,
 			 unsigned long long start);
+int traceeval_1_start_nested(struct traceeval *teval, struct traceeval_key key,
+			     unsigned long long start);
 
 struct traceeval *traceeval_2_alloc(const char *name, const struct traceeval_key_info kinfo[2]);
 
+struct traceeval *traceeval_n_alloc_metrics(const char *name,
+					    const struct traceeval_key_info_array *iarray,
+					    const char * const *metrics, size_t nr_metrics);
+size_t traceeval_nr_metrics(struct traceeval *teval);
+int traceeval_metric_id(struct traceeval *teval, const char *name);
+const char *traceeval_metric_name(struct traceeval *teval, int metric);
+
+int traceeval_n_metric_start(struct traceeval *teval, const struct traceeval_key *keys,
+			     int metric, unsigned long long start);
+int traceeval_n_metric_stop(struct traceeval *teval, const struct traceeval_key *keys,
+			    int metric, unsigned long long stop);
+int traceeval_n_metric_continue(struct traceeval *teval, const struct traceeval_key *keys,
+				int metric, unsigned long long start);
+int traceeval_n_metric_start_nested(struct traceeval *teval, const struct traceeval_key *keys,
+				    int metric, unsigned long long start);
+
+ssize_t traceeval_result_indx_metric_cnt(struct traceeval *teval, size_t index, int metric);
+ssize_t traceeval_result_indx_metric_total(struct traceeval *teval, size_t index, int metric);
+ssize_t traceeval_result_indx_metric_max(struct traceeval *teval, size_t index, int metric);
+ssize_t traceeval_result_indx_metric_min(struct traceeval *teval, size_t index, int metric);
+
+ssize_t traceeval_result_keys_metric_cnt(struct traceeval *teval,
+					 const struct traceeval_key *keys, int metric);
+ssize_t traceeval_result_keys_metric_total(struct traceeval *teval,
+					   const struct traceeval_key *keys, int metric);
+ssize_t traceeval_result_keys_metric_max(struct traceeval *teval,
+					 const struct traceeval_key *keys, int metric);
+ssize_t traceeval_result_keys_metric_min(struct traceeval *teval,
+					 const struct traceeval_key *keys, int metric);
+
+struct traceeval *traceeval_rollup(struct traceeval *teval, const char *name,
+				   const size_t *key_indexes, size_t nr_keys);
+int traceeval_merge(struct traceeval *dst, struct traceeval *src);
+
+void traceeval_reset(struct traceeval *teval);
+
+struct traceeval_epoch *traceeval_epoch_alloc(struct traceeval *teval);
+void traceeval_epoch_free(struct traceeval_epoch *epoch);
+struct traceeval *traceeval_epoch_get(struct traceeval_epoch *epoch);
+void traceeval_epoch_put(struct traceeval_epoch *epoch, struct traceeval *teval);
+struct traceeval *traceeval_epoch_swap(struct traceeval_epoch *epoch);
+int traceeval_epoch_release(struct traceeval_epoch *epoch, struct traceeval *teval);
+
 int traceeval_sort_totals(struct traceeval *teval, bool ascending);
 int traceeval_sort_max(struct traceeval *teval, bool ascending);
 int traceeval_sort_min(struct traceeval *teval, bool ascending);
 int traceeval_sort_cnt(struct traceeval *teval, bool ascending);
 int traceeval_sort_keys(struct traceeval *teval, bool ascending);
 
+int traceeval_sort_metric_totals(struct traceeval *teval, int metric, bool ascending);
+int traceeval_sort_metric_max(struct traceeval *teval, int metric, bool ascending);
+int traceeval_sort_metric_min(struct traceeval *teval, int metric, bool ascending);
+int traceeval_sort_metric_cnt(struct traceeval *teval, int metric, bool ascending);
+
 typedef int (*traceeval_cmp_func)(struct traceeval *teval,
 				  const struct traceeval_key_array *A,
 				  const struct traceeval_key_array *B,
@@ -117,4 +171,80 @@ typedef int (*traceeval_cmp_func)(struct traceeval *teval,
 
 int traceeval_sort_custom(struct traceeval *teval, traceeval_cmp_func cmp, void *data);
 
+enum traceeval_sort_field {
+	TRACEEVAL_SORT_KEY,
+	TRACEEVAL_SORT_TOTAL,
+	TRACEEVAL_SORT_MAX,
+	TRACEEVAL_SORT_MIN,
+	TRACEEVAL_SORT_CNT,
+};
+
+struct traceeval_sort_spec {
+	enum traceeval_sort_field	field;
+	/* the key index for TRACEEVAL_SORT_KEY, otherwise the metric */
+	int				index;
+	bool				ascending;
+};
+
+int traceeval_sort_spec(struct traceeval *teval, const struct traceeval_sort_spec *spec,
+			size_t nr_specs);
+
+int traceeval_set_sort_threads(struct traceeval *teval, int nr_threads, size_t threshold);
+
+ssize_t traceeval_key_array_cnt(const struct traceeval_key_array *karray);
+ssize_t traceeval_key_array_total(const struct traceeval_key_array *karray);
+ssize_t traceeval_key_array_max(const struct traceeval_key_array *karray);
+ssize_t traceeval_key_array_min(const struct traceeval_key_array *karray);
+
+ssize_t traceeval_key_array_metric_cnt(const struct traceeval_key_array *karray, int metric);
+ssize_t traceeval_key_array_metric_total(const struct traceeval_key_array *karray, int metric);
+ssize_t traceeval_key_array_metric_max(const struct traceeval_key_array *karray, int metric);
+ssize_t traceeval_key_array_metric_min(const struct traceeval_key_array *karray, int metric);
+
+typedef int (*traceeval_iter_func)(struct traceeval *teval,
+				   const struct traceeval_key_array *karray,
+				   void *data);
+
+int traceeval_add_index(struct traceeval *teval, size_t nr_keys);
+ssize_t traceeval_query_prefix(struct traceeval *teval, const struct traceeval_key *keys,
+			       size_t nr_keys, traceeval_iter_func func, void *data);
+
+size_t traceeval_nr_changed(struct traceeval *teval);
+ssize_t traceeval_iterate_changed(struct traceeval *teval, traceeval_iter_func func,
+				  void *data);
+void traceeval_clear_changed(struct traceeval *teval);
+
+struct traceeval_stats {
+	size_t			nr_entries;
+	size_t			nr_buckets;
+	size_t			used_buckets;
+	double			load_factor;
+	size_t			max_chain;
+	double			avg_chain;
+	unsigned long long	lookups;
+	unsigned long long	misses;
+	unsigned long long	probes;
+	unsigned long long	inserts;
+	unsigned long long	nr_sorts;
+	unsigned long long	sort_ns;
+	size_t			table_bytes;
+	size_t			entry_bytes;
+	size_t			key_bytes;
+	size_t			result_bytes;
+	size_t			index_bytes;
+};
+
+int traceeval_get_stats(struct traceeval *teval, struct traceeval_stats *stats);
+
+enum traceeval_export_format {
+	TRACEEVAL_EXPORT_CSV,
+	TRACEEVAL_EXPORT_BINARY,
+};
+
+int traceeval_export(struct traceeval *teval, int fd,
+		     enum traceeval_export_format format);
+struct traceeval_export *traceeval_export_start(struct traceeval *teval, int fd,
+						enum traceeval_export_format format);
+int traceeval_export_wait(struct traceeval_export *export);
+
 #endif /* __LIBTRACEEVAL_H__ */
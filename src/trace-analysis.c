@@ -4,49 +4,36 @@
  */
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
 #include <traceeval.h>
 
-#define HASH_BITS 10
-#define HASH_SIZE (1 << HASH_BITS)
-#define HASH_MASK (HASH_SIZE - 1)
-
-enum sort_type {
-	NONE,
-	KEYS,
-	TOTALS,
-	MAX,
-	MIN,
-	CNT,
-};
-
-struct traceeval_key_info_array {
-	size_t				nr_keys;
-	struct traceeval_key_info	*keys;
-};
+#include "traceeval-local.h"
 
-struct eval_instance {
-	unsigned long long	total;
-	unsigned long long	last;
-	unsigned long long	max;
-	unsigned long long	min;
-	unsigned long long	cnt;
-	size_t			nr_keys;
-	struct traceeval_key	*keys;
-	void			*private;
-};
+/* Results with at least this many entries are sorted with threads */
+#define SORT_THREAD_THRESHOLD	(1 << 17)
 
-struct eval_hash {
-	struct eval_hash		*next;
-	struct eval_instance		eval;
-};
+/* Tables with at least this many entries are rolled up with threads */
+#define ROLLUP_THREAD_THRESHOLD	(1 << 16)
 
-struct traceeval {
-	struct traceeval_key_info_array		array;
-	struct eval_instance			*evals;
-	struct eval_hash			*eval_hash[HASH_SIZE];
-	size_t					nr_evals;
-	struct eval_instance			*results;
-	enum sort_type				sort_type;
+/*
+ * The lookup and sort counters reported by traceeval_get_stats() are
+ * plain increments on the table. Build with -DTRACEEVAL_NO_COUNTERS to
+ * compile them out of the hot path, in which case they read as zero.
+ */
+#ifdef TRACEEVAL_NO_COUNTERS
+# define eval_count(teval, field, val)	do { } while (0)
+#else
+# define eval_count(teval, field, val)	((teval)->counters.field += (val))
+#endif
+
+struct traceeval_epoch {
+	struct traceeval			*current;
+	struct traceeval			*standby;
+	/* The table returned by the last swap, until it is released */
+	struct traceeval			*swapped;
+	unsigned int				nr_swaps;
 };
 
 struct traceeval_result_array {
@@ -88,12 +75,22 @@ int traceeval_key_info_array_add(struct traceeval_key_info_array *tarray,
 	return 0;
 }
 
+/*
+ * Allocate a table where every instance holds @nr_metrics independent
+ * sets of stats, updated with the traceeval_n_metric_*() functions.
+ * @metrics may be NULL, otherwise it holds a name for each metric that
+ * can be looked up with traceeval_metric_id().
+ */
 struct traceeval *
-traceeval_n_alloc(const char *name, const struct traceeval_key_info_array *keys)
+traceeval_n_alloc_metrics(const char *name, const struct traceeval_key_info_array *keys,
+			  const char * const *metrics, size_t nr_metrics)
 {
 	struct traceeval *teval;
 	int i;
 
+	if (!nr_metrics)
+		return NULL;
+
 	teval = calloc(1, sizeof(*teval));
 	if (!teval)
 		return NULL;
@@ -107,12 +104,78 @@ traceeval_n_alloc(const char *name, const struct traceeval_key_info_array *keys)
 	for (i = 0; i < keys->nr_keys; i++)
 		teval->array.keys[i] = keys->keys[i];
 
+	teval->nr_metrics = nr_metrics;
+	teval->sort_threshold = SORT_THREAD_THRESHOLD;
+
+	if (metrics) {
+		teval->metric_names = calloc(nr_metrics, sizeof(*teval->metric_names));
+		if (!teval->metric_names)
+			goto fail;
+
+		for (i = 0; i < nr_metrics; i++) {
+			if (!metrics[i])
+				continue;
+			teval->metric_names[i] = strdup(metrics[i]);
+			if (!teval->metric_names[i])
+				goto fail;
+		}
+	}
+
 	return teval;
  fail:
-	free(teval);
+	traceeval_free(teval);
 	return NULL;
 }
 
+struct traceeval *
+traceeval_n_alloc(const char *name, const struct traceeval_key_info_array *keys)
+{
+	return traceeval_n_alloc_metrics(name, keys, NULL, 1);
+}
+
+size_t traceeval_nr_metrics(struct traceeval *teval)
+{
+	return teval->nr_metrics;
+}
+
+int traceeval_metric_id(struct traceeval *teval, const char *name)
+{
+	int i;
+
+	if (!teval->metric_names)
+		return -1;
+
+	for (i = 0; i < teval->nr_metrics; i++) {
+		if (teval->metric_names[i] && strcmp(teval->metric_names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *traceeval_metric_name(struct traceeval *teval, int metric)
+{
+	if (!teval->metric_names || metric < 0 || metric >= teval->nr_metrics)
+		return NULL;
+
+	return teval->metric_names[metric];
+}
+
+static void free_index(struct eval_index *index)
+{
+	struct eval_index_entry *entry;
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (entry = index->hash[i]; entry; ) {
+			struct eval_index_entry *tmp = entry;
+			entry = entry->next;
+			free(tmp->evals);
+			free(tmp);
+		}
+	}
+	free(index);
+}
+
 void traceeval_free(struct traceeval *teval)
 {
 	struct eval_hash *ehash;
@@ -123,13 +186,29 @@ void traceeval_free(struct traceeval *teval)
 	for (i = 0; i < HASH_SIZE; i++) {
 		for (ehash = teval->eval_hash[i]; ehash; ) {
 			struct eval_hash *tmp = ehash;
+			int m;
+
 			ehash = ehash->next;
+			for (m = 0; m < teval->nr_metrics; m++)
+				free(tmp->metrics[m].spill);
+			free(tmp->eval.keys);
 			free(tmp);
 		}
 	}
 
+	for (i = 0; i < teval->nr_indexes; i++)
+		free_index(teval->indexes[i]);
+	free(teval->indexes);
+
+	if (teval->metric_names) {
+		for (i = 0; i < teval->nr_metrics; i++)
+			free(teval->metric_names[i]);
+		free(teval->metric_names);
+	}
+
 	free(teval->array.keys);
 	free(teval->evals);
+	free(teval->results);
 	free(teval);
 }
 
@@ -201,9 +280,11 @@ static void free_results (struct traceeval *teval)
 {
 	free(teval->results);
 	teval->results = NULL;
+	teval->sort_type = NONE;
 }
 
-static int make_key(struct traceeval *teval, const struct traceeval_key *keys, int *err)
+static int make_key(struct traceeval_key_info_array *tarray,
+		    const struct traceeval_key *keys, int *err)
 {
 	struct traceeval_key_info *kinfo;
 	bool calc;
@@ -211,8 +292,8 @@ static int make_key(struct traceeval *teval, const struct traceeval_key *keys, i
 	int ret = 0;
 	int i;
 
-	for (i = 0; i < teval->array.nr_keys; i++) {
-		kinfo = &teval->array.keys[i];
+	for (i = 0; i < tarray->nr_keys; i++) {
+		kinfo = &tarray->keys[i];
 
 		/* TBD arrays */
 		if (kinfo->count) {
@@ -272,7 +353,7 @@ static struct eval_hash *find_eval(struct traceeval *teval, const struct traceev
 				   int *err, int *pkey)
 {
 	struct eval_hash *ehash;
-	int key = make_key(teval, keys, err);
+	int key = make_key(&teval->array, keys, err);
 
 	if (key < 0)
 		return NULL;
@@ -280,85 +361,383 @@ static struct eval_hash *find_eval(struct traceeval *teval, const struct traceev
 	if (pkey)
 		*pkey = key;
 
+	eval_count(teval, lookups, 1);
+
 	for (ehash = teval->eval_hash[key]; ehash; ehash = ehash->next) {
+		eval_count(teval, probes, 1);
 		if (cmp_keys(&teval->array, keys, ehash->eval.keys, err) == 0)
 			return ehash;
 	}
+	eval_count(teval, misses, 1);
+	return NULL;
+}
+
+static struct eval_index_entry *
+find_index_entry(struct eval_index *index, const struct traceeval_key *keys,
+		 int *err, int *pkey)
+{
+	struct eval_index_entry *entry;
+	int key = make_key(&index->array, keys, err);
+
+	if (key < 0)
+		return NULL;
+
+	if (pkey)
+		*pkey = key;
+
+	for (entry = index->hash[key]; entry; entry = entry->next) {
+		if (cmp_keys(&index->array, keys, entry->keys, err) == 0)
+			return entry;
+	}
 	return NULL;
 }
 
+static int index_add(struct eval_index *index, struct eval_instance *eval)
+{
+	struct eval_index_entry *entry;
+	struct eval_instance **evals;
+	int err = 0;
+	int key = -1;
+
+	entry = find_index_entry(index, eval->keys, &err, &key);
+	if (!entry) {
+		if (key < 0)
+			return -1;
+
+		entry = calloc(1, sizeof(*entry) +
+			       sizeof(*entry->keys) * index->array.nr_keys);
+		if (!entry)
+			return -1;
+
+		memcpy(entry->keys, eval->keys,
+		       sizeof(*entry->keys) * index->array.nr_keys);
+		entry->next = index->hash[key];
+		index->hash[key] = entry;
+	}
+
+	if (entry->nr_evals == entry->size) {
+		size_t size = entry->size ? entry->size * 2 : 4;
+
+		evals = realloc(entry->evals, sizeof(*evals) * size);
+		if (!evals)
+			return -1;
+		entry->evals = evals;
+		entry->size = size;
+	}
+
+	entry->evals[entry->nr_evals++] = eval;
+	return 0;
+}
+
 static struct eval_hash *
 insert_eval(struct traceeval *teval, const struct traceeval_key *keys, int key)
 {
 	struct eval_instance *eval;
 	struct eval_hash *ehash;
+	size_t size;
+	char *str;
 	int i;
 
-	ehash = calloc(1, sizeof(*ehash));
+	if (key < 0)
+		return NULL;
+
+	/* The metrics are allocated along with the instance */
+	ehash = calloc(1, sizeof(*ehash) + sizeof(*ehash->metrics) * teval->nr_metrics);
 	if (!ehash)
 		return NULL;
 
 	eval = &ehash->eval;
+	eval->metrics = ehash->metrics;
+	eval->nr_metrics = teval->nr_metrics;
+
+	/* Copied strings are kept after the keys, and freed with them */
+	size = sizeof(*eval->keys) * teval->array.nr_keys;
+	if (teval->copy_strings) {
+		for (i = 0; i < teval->array.nr_keys; i++) {
+			if (keys[i].type == TRACEEVAL_TYPE_STRING)
+				size += strlen(keys[i].string) + 1;
+		}
+	}
 
-	eval->keys = calloc(teval->array.nr_keys, sizeof(*eval->keys));
+	eval->keys = calloc(1, size);
 	if (!eval->keys)
-		return NULL;
-	for (i = 0; i < teval->array.nr_keys; i++)
+		goto fail;
+
+	str = (char *)(eval->keys + teval->array.nr_keys);
+	for (i = 0; i < teval->array.nr_keys; i++) {
 		eval->keys[i] = keys[i];
+		if (teval->copy_strings && keys[i].type == TRACEEVAL_TYPE_STRING) {
+			eval->keys[i].string = str;
+			str = stpcpy(str, keys[i].string) + 1;
+		}
+	}
 	eval->nr_keys = teval->array.nr_keys;
+
+	/* Index the instance before it is visible in the hash */
+	for (i = 0; i < teval->nr_indexes; i++) {
+		if (index_add(teval->indexes[i], eval) < 0)
+			goto fail_index;
+	}
+
 	teval->nr_evals++;
+	eval_count(teval, inserts, 1);
 
 	ehash->next = teval->eval_hash[key];
 	teval->eval_hash[key] = ehash;
 
+	/* The results array no longer covers all the instances */
+	free_results(teval);
+
 	return ehash;
+ fail_index:
+	/* Pull the instance back out of the indexes it was added to */
+	while (i--) {
+		struct eval_index_entry *entry;
+		int err = 0;
+
+		entry = find_index_entry(teval->indexes[i], eval->keys, &err, NULL);
+		if (entry && entry->nr_evals && entry->evals[entry->nr_evals - 1] == eval)
+			entry->nr_evals--;
+	}
+ fail:
+	free(eval->keys);
+	free(ehash);
+	return NULL;
 }
 
-static struct eval_instance *
-get_eval_instance(struct traceeval *teval, const struct traceeval_key *keys)
+/* Return the hash bucket of @keys, or -1 if they do not match the table */
+int trace_eval_hash(struct traceeval *teval, const struct traceeval_key *keys)
+{
+	int err = 0;
+
+	return make_key(&teval->array, keys, &err);
+}
+
+/* Move an interval still started in @src, with its nested starts, to @dst */
+static int move_pending(struct eval_metric *dst, struct eval_metric *src)
+{
+	unsigned long long *spill;
+	unsigned int nr;
+
+	if (!src->started)
+		return 0;
+
+	/* The spill array of @src is left alone, its size is read by stats */
+	if (src->depth > NEST_INLINE) {
+		nr = src->depth - NEST_INLINE;
+		if (dst->spill_size < nr) {
+			spill = realloc(dst->spill, sizeof(*spill) * src->spill_size);
+			if (!spill)
+				return -1;
+			dst->spill = spill;
+			dst->spill_size = src->spill_size;
+		}
+		memcpy(dst->spill, src->spill, sizeof(*spill) * nr);
+	}
+
+	memcpy(dst->nest, src->nest, sizeof(dst->nest));
+	dst->depth = src->depth;
+	dst->last = src->last;
+	dst->started = true;
+
+	src->depth = 0;
+	src->last = 0;
+	src->started = false;
+	return 0;
+}
+
+/*
+ * On the first update of @ehash in an epoch, take over the intervals of
+ * its keys still started in the table of the previous epoch. That table
+ * may be read by the reporter, so only its start state is touched, and
+ * it is searched without updating its counters.
+ */
+static int carry_pending(struct traceeval *teval, struct eval_hash *ehash)
+{
+	struct traceeval *carry = teval->carry;
+	struct eval_hash *src;
+	int err = 0;
+	int key;
+	int m;
+
+	ehash->epoch = teval->epoch;
+
+	key = make_key(&carry->array, ehash->eval.keys, &err);
+	if (key < 0)
+		return 0;
+
+	for (src = carry->eval_hash[key]; src; src = src->next) {
+		if (cmp_keys(&carry->array, ehash->eval.keys, src->eval.keys, &err) == 0)
+			break;
+	}
+	if (!src)
+		return 0;
+
+	for (m = 0; m < teval->nr_metrics; m++) {
+		if (move_pending(&ehash->metrics[m], &src->metrics[m]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static struct eval_hash *
+get_eval_hash(struct traceeval *teval, const struct traceeval_key *keys)
 {
 	struct eval_hash *ehash;
 	int err = 0;
 	int key = -1;
 
 	ehash = find_eval(teval, keys, &err, &key);
-	if (!ehash) {
+	if (!ehash)
 		ehash = insert_eval(teval, keys, key);
-		if (!ehash)
-			return NULL;
-	}
+
+	if (ehash && teval->carry && ehash->epoch != teval->epoch &&
+	    carry_pending(teval, ehash) < 0)
+		return NULL;
+
+	return ehash;
+}
+
+static struct eval_instance *
+get_eval_instance(struct traceeval *teval, const struct traceeval_key *keys)
+{
+	struct eval_hash *ehash = get_eval_hash(teval, keys);
+
+	if (!ehash)
+		return NULL;
 	return &ehash->eval;
 }
 
-int traceeval_n_start(struct traceeval *teval, const struct traceeval_key *keys,
-		      unsigned long long start)
+/* Record that the stats of @ehash changed since the last checkpoint */
+static void mark_dirty(struct traceeval *teval, struct eval_hash *ehash)
+{
+	if (ehash->dirty)
+		return;
+
+	ehash->dirty = true;
+	ehash->dirty_next = teval->dirty;
+	teval->dirty = ehash;
+	teval->nr_dirty++;
+}
+
+static struct eval_metric *
+get_eval_metric(struct traceeval *teval, const struct traceeval_key *keys, int metric)
 {
 	struct eval_instance *eval;
 
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return NULL;
+
 	eval = get_eval_instance(teval, keys);
 	if (!eval)
+		return NULL;
+
+	return &eval->metrics[metric];
+}
+
+int traceeval_n_metric_start(struct traceeval *teval, const struct traceeval_key *keys,
+			     int metric, unsigned long long start)
+{
+	struct eval_metric *emetric;
+
+	emetric = get_eval_metric(teval, keys, metric);
+	if (!emetric)
 		return -1;
 
-	eval->last = start;
+	emetric->last = start;
+	emetric->started = true;
 	return 0;
 }
 
-int traceeval_n_continue(struct traceeval *teval, const struct traceeval_key *keys,
-			 unsigned long long start)
+static int push_nested(struct eval_metric *emetric)
 {
-	struct eval_instance *eval;
+	unsigned long long *spill;
+	unsigned int size;
 
-	eval = get_eval_instance(teval, keys);
-	if (!eval)
+	if (emetric->depth < NEST_INLINE) {
+		emetric->nest[emetric->depth++] = emetric->last;
+		return 0;
+	}
+
+	if (emetric->depth - NEST_INLINE == emetric->spill_size) {
+		size = emetric->spill_size ? emetric->spill_size * 2 : 8;
+		spill = realloc(emetric->spill, sizeof(*spill) * size);
+		if (!spill)
+			return -1;
+		emetric->spill = spill;
+		emetric->spill_size = size;
+	}
+
+	emetric->spill[emetric->depth++ - NEST_INLINE] = emetric->last;
+	return 0;
+}
+
+static unsigned long long pop_nested(struct eval_metric *emetric)
+{
+	emetric->depth--;
+	if (emetric->depth < NEST_INLINE)
+		return emetric->nest[emetric->depth];
+	return emetric->spill[emetric->depth - NEST_INLINE];
+}
+
+/*
+ * Like traceeval_n_metric_start(), but if an interval is already started
+ * for @keys, it is kept and resumes being the current one when the new
+ * interval stops. Each stop accounts the innermost started interval.
+ */
+int traceeval_n_metric_start_nested(struct traceeval *teval,
+				    const struct traceeval_key *keys,
+				    int metric, unsigned long long start)
+{
+	struct eval_metric *emetric;
+
+	emetric = get_eval_metric(teval, keys, metric);
+	if (!emetric)
+		return -1;
+
+	if (emetric->started && push_nested(emetric) < 0)
+		return -1;
+
+	emetric->last = start;
+	emetric->started = true;
+	return 0;
+}
+
+int traceeval_n_start_nested(struct traceeval *teval, const struct traceeval_key *keys,
+			     unsigned long long start)
+{
+	return traceeval_n_metric_start_nested(teval, keys, 0, start);
+}
+
+int traceeval_n_start(struct traceeval *teval, const struct traceeval_key *keys,
+		      unsigned long long start)
+{
+	return traceeval_n_metric_start(teval, keys, 0, start);
+}
+
+int traceeval_n_metric_continue(struct traceeval *teval, const struct traceeval_key *keys,
+				int metric, unsigned long long start)
+{
+	struct eval_metric *emetric;
+
+	emetric = get_eval_metric(teval, keys, metric);
+	if (!emetric)
 		return -1;
 
-	if (eval->last)
+	if (emetric->started)
 		return 0;
 
-	eval->last = start;
+	emetric->last = start;
+	emetric->started = true;
 	return 0;
 }
 
+int traceeval_n_continue(struct traceeval *teval, const struct traceeval_key *keys,
+			 unsigned long long start)
+{
+	return traceeval_n_metric_continue(teval, keys, 0, start);
+}
+
 int traceeval_n_set_private(struct traceeval *teval, const struct traceeval_key *keys,
 			    void *data)
 {
@@ -384,32 +763,54 @@ void *traceeval_n_get_private(struct traceeval *teval, const struct traceeval_ke
 	return ehash->eval.private;
 }
 
-int traceeval_n_stop(struct traceeval *teval, const struct traceeval_key *keys,
-		     unsigned long long stop)
+int traceeval_n_metric_stop(struct traceeval *teval, const struct traceeval_key *keys,
+			    int metric, unsigned long long stop)
 {
-	struct eval_instance *eval;
+	struct eval_metric *emetric;
+	struct eval_hash *ehash;
 	unsigned long long delta;
 
-	eval = get_eval_instance(teval, keys);
-	if (!eval)
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return -1;
+
+	ehash = get_eval_hash(teval, keys);
+	if (!ehash)
 		return -1;
 
-	if (!eval->last)
+	emetric = &ehash->metrics[metric];
+
+	if (!emetric->started)
 		return 1;
 
-	delta = stop - eval->last;
-	eval->total += delta;
-	if (!eval->min || eval->min > delta)
-		eval->min = delta;
-	if (eval->max < delta)
-		eval->max = delta;
-	eval->cnt++;
+	delta = stop - emetric->last;
+	emetric->total += delta;
+	if (!emetric->cnt || emetric->min > delta)
+		emetric->min = delta;
+	if (emetric->max < delta)
+		emetric->max = delta;
+	emetric->cnt++;
+
+	if (emetric->depth) {
+		emetric->last = pop_nested(emetric);
+	} else {
+		emetric->last = 0;
+		emetric->started = false;
+	}
+
+	mark_dirty(teval, ehash);
 
-	eval->last = 0;
+	/* The results share the metrics, but their order is now stale */
+	teval->sort_type = NONE;
 
 	return 0;
 }
 
+int traceeval_n_stop(struct traceeval *teval, const struct traceeval_key *keys,
+		     unsigned long long stop)
+{
+	return traceeval_n_metric_stop(teval, keys, 0, stop);
+}
+
 size_t traceeval_result_nr(struct traceeval *teval)
 {
 	return teval->nr_evals;
@@ -436,39 +837,221 @@ traceeval_key_array_indx(const struct traceeval_key_array *karray, size_t index)
 	return &eval->keys[index];
 }
 
-static int create_results(struct traceeval *teval)
+ssize_t traceeval_key_array_metric_cnt(const struct traceeval_key_array *karray, int metric)
 {
-	struct eval_hash *ehash;
-	int r = 0;
-	int i;
-
-	if (teval->results)
-		return 0;
+	const struct eval_instance *eval = (const struct eval_instance *)karray;
 
-	teval->results = calloc(teval->nr_evals, sizeof(*teval->results));
-	if (!teval->results)
+	if (!karray || metric < 0 || metric >= eval->nr_metrics)
 		return -1;
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next) {
-			teval->results[r++] = ehash->eval;
-		}
-	}
-	return 0;
+	return eval->metrics[metric].cnt;
 }
 
-static int eval_sort(struct traceeval *teval, enum sort_type sort_type, bool ascending);
+ssize_t traceeval_key_array_cnt(const struct traceeval_key_array *karray)
+{
+	return traceeval_key_array_metric_cnt(karray, 0);
+}
 
-static struct eval_instance *get_result(struct traceeval *teval, size_t index)
+ssize_t traceeval_key_array_metric_total(const struct traceeval_key_array *karray, int metric)
 {
-	if (index >= teval->nr_evals)
-		return NULL;
+	const struct eval_instance *eval = (const struct eval_instance *)karray;
 
-	if (!teval->results) {
-		create_results(teval);
+	if (!karray || metric < 0 || metric >= eval->nr_metrics)
+		return -1;
+
+	return eval->metrics[metric].total;
+}
+
+ssize_t traceeval_key_array_total(const struct traceeval_key_array *karray)
+{
+	return traceeval_key_array_metric_total(karray, 0);
+}
+
+ssize_t traceeval_key_array_metric_max(const struct traceeval_key_array *karray, int metric)
+{
+	const struct eval_instance *eval = (const struct eval_instance *)karray;
+
+	if (!karray || metric < 0 || metric >= eval->nr_metrics)
+		return -1;
+
+	return eval->metrics[metric].max;
+}
+
+ssize_t traceeval_key_array_max(const struct traceeval_key_array *karray)
+{
+	return traceeval_key_array_metric_max(karray, 0);
+}
+
+ssize_t traceeval_key_array_metric_min(const struct traceeval_key_array *karray, int metric)
+{
+	const struct eval_instance *eval = (const struct eval_instance *)karray;
+
+	if (!karray || metric < 0 || metric >= eval->nr_metrics)
+		return -1;
+
+	return eval->metrics[metric].min;
+}
+
+ssize_t traceeval_key_array_min(const struct traceeval_key_array *karray)
+{
+	return traceeval_key_array_metric_min(karray, 0);
+}
+
+static struct eval_index *find_index(struct traceeval *teval, size_t nr_keys)
+{
+	int i;
+
+	for (i = 0; i < teval->nr_indexes; i++) {
+		if (teval->indexes[i]->array.nr_keys == nr_keys)
+			return teval->indexes[i];
+	}
+	return NULL;
+}
+
+/*
+ * Add a secondary index on the first @nr_keys keys of @teval, so that
+ * traceeval_query_prefix() with that many keys only visits the
+ * instances that match. The index is populated with the instances
+ * already in @teval and is maintained on every insert after that.
+ */
+int traceeval_add_index(struct traceeval *teval, size_t nr_keys)
+{
+	struct eval_index **indexes;
+	struct eval_index *index;
+	struct eval_hash *ehash;
+	int i;
+
+	if (!nr_keys || nr_keys >= teval->array.nr_keys)
+		return -1;
+
+	if (find_index(teval, nr_keys))
+		return 0;
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return -1;
+
+	index->array.nr_keys = nr_keys;
+	index->array.keys = teval->array.keys;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next) {
+			if (index_add(index, &ehash->eval) < 0)
+				goto fail;
+		}
+	}
+
+	indexes = realloc(teval->indexes, sizeof(*indexes) * (teval->nr_indexes + 1));
+	if (!indexes)
+		goto fail;
+
+	teval->indexes = indexes;
+	teval->indexes[teval->nr_indexes++] = index;
+
+	return 0;
+ fail:
+	free_index(index);
+	return -1;
+}
+
+/*
+ * Call @func for every instance whose first @nr_keys keys match @keys.
+ * Uses the index on @nr_keys if one was added with traceeval_add_index(),
+ * otherwise falls back to walking the entire table. If @func returns
+ * non-zero the walk stops.
+ *
+ * Returns the number of instances passed to @func, or -1 on error.
+ */
+ssize_t traceeval_query_prefix(struct traceeval *teval, const struct traceeval_key *keys,
+			       size_t nr_keys, traceeval_iter_func func, void *data)
+{
+	struct traceeval_key_info_array prefix;
+	struct eval_index_entry *entry;
+	struct eval_index *index;
+	struct eval_hash *ehash;
+	ssize_t cnt = 0;
+	int err = 0;
+	int i;
+
+	if (!nr_keys || nr_keys > teval->array.nr_keys)
+		return -1;
+
+	if (nr_keys == teval->array.nr_keys) {
+		ehash = find_eval(teval, keys, &err, NULL);
+		if (err)
+			return -1;
+		if (!ehash)
+			return 0;
+		func(teval, (struct traceeval_key_array *)&ehash->eval, data);
+		return 1;
+	}
+
+	index = find_index(teval, nr_keys);
+	if (index) {
+		entry = find_index_entry(index, keys, &err, NULL);
+		if (err)
+			return -1;
+		if (!entry)
+			return 0;
+		for (i = 0; i < entry->nr_evals; i++) {
+			cnt++;
+			if (func(teval, (struct traceeval_key_array *)entry->evals[i], data))
+				break;
+		}
+		return cnt;
+	}
+
+	prefix.nr_keys = nr_keys;
+	prefix.keys = teval->array.keys;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next) {
+			if (cmp_keys(&prefix, keys, ehash->eval.keys, &err) != 0)
+				continue;
+			cnt++;
+			if (func(teval, (struct traceeval_key_array *)&ehash->eval, data))
+				return cnt;
+		}
+		if (err)
+			return -1;
+	}
+	return cnt;
+}
+
+static int create_results(struct traceeval *teval)
+{
+	struct eval_hash *ehash;
+	int r = 0;
+	int i;
+
+	if (teval->results)
+		return 0;
+
+	teval->results = calloc(teval->nr_evals, sizeof(*teval->results));
+	if (!teval->results)
+		return -1;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next) {
+			teval->results[r++] = ehash->eval;
+		}
+	}
+	return 0;
+}
+
+static int eval_sort(struct traceeval *teval, enum sort_type sort_type,
+		     int metric, bool ascending);
+
+static struct eval_instance *get_result(struct traceeval *teval, size_t index)
+{
+	if (index >= teval->nr_evals)
+		return NULL;
+
+	if (!teval->results) {
+		create_results(teval);
 		if (!teval->results)
 			return NULL;
-		eval_sort(teval, KEYS, true);
+		eval_sort(teval, KEYS, 0, true);
 	}
 
 	if (teval->results)
@@ -477,6 +1060,15 @@ static struct eval_instance *get_result(struct traceeval *teval, size_t index)
 	return &teval->evals[index];
 }
 
+/* Make sure the results exist, sorted by keys if they were not yet sorted */
+int trace_eval_get_results(struct traceeval *teval)
+{
+	if (!teval->nr_evals)
+		return 0;
+
+	return get_result(teval, 0) ? 0 : -1;
+}
+
 struct traceeval_key_array *
 traceeval_result_indx_key_array(struct traceeval *teval, size_t index)
 {
@@ -489,96 +1081,160 @@ traceeval_result_indx_key_array(struct traceeval *teval, size_t index)
 }
 
 ssize_t
-traceeval_result_indx_cnt(struct traceeval *teval, size_t index)
+traceeval_result_indx_metric_cnt(struct traceeval *teval, size_t index, int metric)
 {
 	struct eval_instance *eval = get_result(teval, index);
 
-	if (!eval)
+	if (!eval || metric < 0 || metric >= eval->nr_metrics)
 		return -1;
 
-	return eval->cnt;
+	return eval->metrics[metric].cnt;
 }
 
 ssize_t
-traceeval_result_indx_total(struct traceeval *teval, size_t index)
+traceeval_result_indx_cnt(struct traceeval *teval, size_t index)
+{
+	return traceeval_result_indx_metric_cnt(teval, index, 0);
+}
+
+ssize_t
+traceeval_result_indx_metric_total(struct traceeval *teval, size_t index, int metric)
 {
 	struct eval_instance *eval = get_result(teval, index);
 
-	if (!eval)
+	if (!eval || metric < 0 || metric >= eval->nr_metrics)
 		return -1;
 
-	return eval->total;
+	return eval->metrics[metric].total;
 }
 
 ssize_t
-traceeval_result_indx_max(struct traceeval *teval, size_t index)
+traceeval_result_indx_total(struct traceeval *teval, size_t index)
+{
+	return traceeval_result_indx_metric_total(teval, index, 0);
+}
+
+ssize_t
+traceeval_result_indx_metric_max(struct traceeval *teval, size_t index, int metric)
 {
 	struct eval_instance *eval = get_result(teval, index);
 
-	if (!eval)
+	if (!eval || metric < 0 || metric >= eval->nr_metrics)
 		return -1;
 
-	return eval->max;
+	return eval->metrics[metric].max;
 }
 
 ssize_t
-traceeval_result_indx_min(struct traceeval *teval, size_t index)
+traceeval_result_indx_max(struct traceeval *teval, size_t index)
+{
+	return traceeval_result_indx_metric_max(teval, index, 0);
+}
+
+ssize_t
+traceeval_result_indx_metric_min(struct traceeval *teval, size_t index, int metric)
 {
 	struct eval_instance *eval = get_result(teval, index);
 
-	if (!eval)
+	if (!eval || metric < 0 || metric >= eval->nr_metrics)
 		return -1;
 
-	return eval->min;
+	return eval->metrics[metric].min;
+}
+
+ssize_t
+traceeval_result_indx_min(struct traceeval *teval, size_t index)
+{
+	return traceeval_result_indx_metric_min(teval, index, 0);
 }
 
 
 ssize_t
-traceeval_result_keys_cnt(struct traceeval *teval, const struct traceeval_key *keys)
+traceeval_result_keys_metric_cnt(struct traceeval *teval, const struct traceeval_key *keys,
+			       int metric)
 {
 	struct eval_hash *ehash;
 	int err = 0;
 
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return -1;
+
 	ehash = find_eval(teval, keys, &err, NULL);
 	if (!ehash)
 		return -1;
-	return ehash->eval.cnt;
+	return ehash->metrics[metric].cnt;
 }
 
 ssize_t
-traceeval_result_keys_total(struct traceeval *teval, const struct traceeval_key *keys)
+traceeval_result_keys_cnt(struct traceeval *teval, const struct traceeval_key *keys)
+{
+	return traceeval_result_keys_metric_cnt(teval, keys, 0);
+}
+
+ssize_t
+traceeval_result_keys_metric_total(struct traceeval *teval, const struct traceeval_key *keys,
+			       int metric)
 {
 	struct eval_hash *ehash;
 	int err = 0;
 
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return -1;
+
 	ehash = find_eval(teval, keys, &err, NULL);
 	if (!ehash)
 		return -1;
-	return ehash->eval.total;
+	return ehash->metrics[metric].total;
 }
 
 ssize_t
-traceeval_result_keys_max(struct traceeval *teval, const struct traceeval_key *keys)
+traceeval_result_keys_total(struct traceeval *teval, const struct traceeval_key *keys)
+{
+	return traceeval_result_keys_metric_total(teval, keys, 0);
+}
+
+ssize_t
+traceeval_result_keys_metric_max(struct traceeval *teval, const struct traceeval_key *keys,
+			       int metric)
 {
 	struct eval_hash *ehash;
 	int err = 0;
 
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return -1;
+
 	ehash = find_eval(teval, keys, &err, NULL);
 	if (!ehash)
 		return -1;
-	return ehash->eval.max;
+	return ehash->metrics[metric].max;
 }
 
 ssize_t
-traceeval_result_keys_min(struct traceeval *teval, const struct traceeval_key *keys)
+traceeval_result_keys_max(struct traceeval *teval, const struct traceeval_key *keys)
+{
+	return traceeval_result_keys_metric_max(teval, keys, 0);
+}
+
+ssize_t
+traceeval_result_keys_metric_min(struct traceeval *teval, const struct traceeval_key *keys,
+			       int metric)
 {
 	struct eval_hash *ehash;
 	int err = 0;
 
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return -1;
+
 	ehash = find_eval(teval, keys, &err, NULL);
 	if (!ehash)
 		return -1;
-	return ehash->eval.min;
+	return ehash->metrics[metric].min;
+}
+
+ssize_t
+traceeval_result_keys_min(struct traceeval *teval, const struct traceeval_key *keys)
+{
+	return traceeval_result_keys_metric_min(teval, keys, 0);
 }
 
 struct traceeval *
@@ -624,6 +1280,14 @@ void *traceeval_1_get_private(struct traceeval *teval, struct traceeval_key key)
 	return traceeval_n_get_private(teval, keys);
 }
 
+int traceeval_1_start_nested(struct traceeval *teval, struct traceeval_key key,
+			     unsigned long long start)
+{
+	struct traceeval_key keys[1] = { key };
+
+	return traceeval_n_start_nested(teval, keys, start);
+}
+
 int traceeval_1_stop(struct traceeval *teval, struct traceeval_key key,
 		     unsigned long long stop)
 {
@@ -644,133 +1308,681 @@ traceeval_2_alloc(const char *name, const struct traceeval_key_info kinfo[2])
 	return traceeval_n_alloc(name, &karray);
 }
 
-static int cmp_totals(const void *A, const void *B)
+/* Fold the stats of @src into @dst */
+static void merge_metric(struct eval_metric *dst, const struct eval_metric *src)
 {
-	const struct eval_instance *a = A;
-	const struct eval_instance *b = B;
+	if (!src->cnt)
+		return;
+
+	if (!dst->cnt || dst->min > src->min)
+		dst->min = src->min;
+	if (dst->max < src->max)
+		dst->max = src->max;
+	dst->total += src->total;
+	dst->cnt += src->cnt;
+}
+
+static void merge_instance(struct eval_instance *dst, const struct eval_instance *src)
+{
+	int i;
 
-	if (a->total < b->total)
+	for (i = 0; i < dst->nr_metrics; i++)
+		merge_metric(&dst->metrics[i], &src->metrics[i]);
+}
+
+struct rollup_work {
+	struct traceeval		*teval;
+	struct traceeval		*rollup;
+	const size_t			*key_indexes;
+	size_t				nr_keys;
+	/* The range of hash buckets of @teval to walk */
+	int				first;
+	int				last;
+	pthread_t			thread;
+	bool				started;
+	int				ret;
+};
+
+static int rollup_buckets(struct rollup_work *work)
+{
+	struct traceeval_key *keys;
+	struct eval_hash *ehash;
+	struct eval_hash *dst;
+	int i, k;
+
+	keys = calloc(work->nr_keys, sizeof(*keys));
+	if (!keys)
 		return -1;
-	return a->total > b->total;
+
+	for (i = work->first; i < work->last; i++) {
+		for (ehash = work->teval->eval_hash[i]; ehash; ehash = ehash->next) {
+			for (k = 0; k < work->nr_keys; k++)
+				keys[k] = ehash->eval.keys[work->key_indexes[k]];
+
+			dst = get_eval_hash(work->rollup, keys);
+			if (!dst) {
+				free(keys);
+				return -1;
+			}
+
+			merge_instance(&dst->eval, &ehash->eval);
+			mark_dirty(work->rollup, dst);
+		}
+	}
+
+	free(keys);
+	return 0;
 }
 
-static int cmp_max(const void *A, const void *B)
+static void *rollup_thread(void *data)
+{
+	struct rollup_work *work = data;
+
+	work->ret = rollup_buckets(work);
+	return NULL;
+}
+
+/* Split the buckets over threads that each fill a table of their own */
+static int rollup_threads(struct traceeval *teval, struct traceeval *rollup,
+			  const size_t *key_indexes, size_t nr_keys, int nr_threads)
+{
+	struct rollup_work *works;
+	int ret = 0;
+	int i;
+
+	works = calloc(nr_threads, sizeof(*works));
+	if (!works)
+		return -1;
+
+	for (i = 0; i < nr_threads; i++) {
+		works[i].teval = teval;
+		works[i].key_indexes = key_indexes;
+		works[i].nr_keys = nr_keys;
+		works[i].first = HASH_SIZE * i / nr_threads;
+		works[i].last = HASH_SIZE * (i + 1) / nr_threads;
+		works[i].rollup = trace_eval_alloc_like(rollup);
+		if (!works[i].rollup) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&works[i].thread, NULL, rollup_thread, &works[i]))
+			break;
+		works[i].started = true;
+	}
+
+	/* Whatever could not be handed to a thread is done here */
+	for (; i < nr_threads; i++)
+		works[i].ret = rollup_buckets(&works[i]);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (works[i].started)
+			pthread_join(works[i].thread, NULL);
+		if (works[i].ret < 0)
+			ret = -1;
+	}
+
+	for (i = 0; !ret && i < nr_threads; i++)
+		ret = traceeval_merge(rollup, works[i].rollup);
+ out:
+	for (i = 0; i < nr_threads; i++)
+		traceeval_free(works[i].rollup);
+	free(works);
+	return ret;
+}
+
+/*
+ * Create a new table keyed on the keys of @teval listed in @key_indexes,
+ * where every instance holds the combined stats of all the instances of
+ * @teval that project onto its keys. The stats are combined with
+ * merge_instance(), which is associative, so for tables of at least
+ * ROLLUP_THREAD_THRESHOLD instances the hash buckets are split over one
+ * thread per online CPU. Each thread rolls up its buckets into a table
+ * of its own, and those are merged at the end. Private data and pending
+ * starts are not carried over.
+ */
+struct traceeval *
+traceeval_rollup(struct traceeval *teval, const char *name,
+		 const size_t *key_indexes, size_t nr_keys)
+{
+	struct traceeval_key_info_array iarray;
+	struct rollup_work work;
+	struct traceeval *rollup;
+	int nr_threads = 1;
+	int ret;
+	int k;
+
+	if (!nr_keys)
+		return NULL;
+
+	iarray.nr_keys = nr_keys;
+	iarray.keys = calloc(nr_keys, sizeof(*iarray.keys));
+	if (!iarray.keys)
+		return NULL;
+
+	for (k = 0; k < nr_keys; k++) {
+		if (key_indexes[k] >= teval->array.nr_keys)
+			goto fail_keys;
+		iarray.keys[k] = teval->array.keys[key_indexes[k]];
+	}
+
+	rollup = traceeval_n_alloc_metrics(name, &iarray,
+					   (const char * const *)teval->metric_names,
+					   teval->nr_metrics);
+	if (!rollup)
+		goto fail_keys;
+
+	rollup->copy_strings = teval->copy_strings;
+
+	if (teval->nr_evals >= ROLLUP_THREAD_THRESHOLD)
+		nr_threads = trace_eval_threads(0);
+
+	if (nr_threads > 1) {
+		ret = rollup_threads(teval, rollup, key_indexes, nr_keys, nr_threads);
+	} else {
+		memset(&work, 0, sizeof(work));
+		work.teval = teval;
+		work.rollup = rollup;
+		work.key_indexes = key_indexes;
+		work.nr_keys = nr_keys;
+		work.last = HASH_SIZE;
+		ret = rollup_buckets(&work);
+	}
+
+	if (ret < 0)
+		goto fail;
+
+	free(iarray.keys);
+	return rollup;
+ fail:
+	traceeval_free(rollup);
+ fail_keys:
+	free(iarray.keys);
+	return NULL;
+}
+
+/*
+ * Fold the stats of every instance of @src into the instance of @dst with
+ * the same keys, creating it if needed. Both tables must have the same
+ * key types and number of metrics. Private data and pending starts of
+ * @src are not carried over.
+ */
+int traceeval_merge(struct traceeval *dst, struct traceeval *src)
+{
+	struct eval_hash *ehash;
+	struct eval_hash *d;
+	int i;
+
+	if (dst->array.nr_keys != src->array.nr_keys ||
+	    dst->nr_metrics != src->nr_metrics)
+		return -1;
+
+	for (i = 0; i < dst->array.nr_keys; i++) {
+		if (dst->array.keys[i].type != src->array.keys[i].type)
+			return -1;
+	}
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (ehash = src->eval_hash[i]; ehash; ehash = ehash->next) {
+			d = get_eval_hash(dst, ehash->eval.keys);
+			if (!d)
+				return -1;
+
+			merge_instance(&d->eval, &ehash->eval);
+			mark_dirty(dst, d);
+		}
+	}
+
+	/* The results share the metrics, but their order is now stale */
+	dst->sort_type = NONE;
+
+	return 0;
+}
+
+size_t traceeval_nr_changed(struct traceeval *teval)
+{
+	return teval->nr_dirty;
+}
+
+/*
+ * Call @func for every instance whose stats changed since it was last
+ * passed to this function (or since the last reset), and clear it from
+ * the changed set. If @func returns non-zero, the walk stops and the
+ * instances not yet visited stay in the set.
+ *
+ * Returns the number of instances passed to @func.
+ */
+ssize_t traceeval_iterate_changed(struct traceeval *teval, traceeval_iter_func func,
+				  void *data)
+{
+	struct eval_hash *ehash;
+	ssize_t cnt = 0;
+	int ret;
+
+	while (teval->dirty) {
+		ehash = teval->dirty;
+		teval->dirty = ehash->dirty_next;
+		teval->nr_dirty--;
+		ehash->dirty = false;
+		ehash->dirty_next = NULL;
+
+		cnt++;
+		ret = func(teval, (struct traceeval_key_array *)&ehash->eval, data);
+		if (ret)
+			break;
+	}
+	return cnt;
+}
+
+void traceeval_clear_changed(struct traceeval *teval)
+{
+	struct eval_hash *ehash;
+
+	while (teval->dirty) {
+		ehash = teval->dirty;
+		teval->dirty = ehash->dirty_next;
+		ehash->dirty = false;
+		ehash->dirty_next = NULL;
+	}
+	teval->nr_dirty = 0;
+}
+
+static void reset_metrics(struct traceeval *teval, bool clear_pending)
+{
+	struct eval_hash *ehash;
+	int i, m;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next) {
+			ehash->dirty = false;
+			for (m = 0; m < teval->nr_metrics; m++) {
+				struct eval_metric *emetric = &ehash->metrics[m];
+
+				emetric->total = 0;
+				emetric->max = 0;
+				emetric->min = 0;
+				emetric->cnt = 0;
+				if (clear_pending) {
+					emetric->last = 0;
+					emetric->started = false;
+					emetric->depth = 0;
+				}
+			}
+		}
+	}
+
+	teval->dirty = NULL;
+	teval->nr_dirty = 0;
+
+	/* The results still hold every instance, only the order is stale */
+	teval->sort_type = NONE;
+}
+
+/*
+ * Zero the stats of all instances of @teval, while keeping the instances,
+ * their keys, private data and indexes as well as any started intervals.
+ * No memory is allocated or freed.
+ */
+void traceeval_reset(struct traceeval *teval)
+{
+	reset_metrics(teval, false);
+}
+
+/* Allocate an empty table with the same keys, metrics and indexes as @teval */
+struct traceeval *trace_eval_alloc_like(struct traceeval *teval)
+{
+	struct traceeval *copy;
+	int i;
+
+	copy = traceeval_n_alloc_metrics(NULL, &teval->array,
+					 (const char * const *)teval->metric_names,
+					 teval->nr_metrics);
+	if (!copy)
+		return NULL;
+
+	copy->sort_threads = teval->sort_threads;
+	copy->sort_threshold = teval->sort_threshold;
+	copy->copy_strings = teval->copy_strings;
+
+	for (i = 0; i < teval->nr_indexes; i++) {
+		if (traceeval_add_index(copy, teval->indexes[i]->array.nr_keys) < 0)
+			goto fail;
+	}
+	return copy;
+ fail:
+	traceeval_free(copy);
+	return NULL;
+}
+
+/*
+ * Double buffer @teval for periodic reporting. The ingest side brackets
+ * its updates with traceeval_epoch_get() and traceeval_epoch_put(), and
+ * the reporter calls traceeval_epoch_swap() to take the table of the
+ * epoch that just ended. Once it is done reading it, it hands it back
+ * with traceeval_epoch_release(), which resets it to be used by the
+ * epoch after the next one. Both tables keep their instances across
+ * epochs, so a steady key set does not allocate.
+ *
+ * An interval started before a swap and stopped after it is accounted
+ * in the epoch it stops in: the first update of a key in an epoch moves
+ * its started intervals over from the table of the previous one. For
+ * that, the previous table is only released for reuse, not reset of its
+ * started intervals, and traceeval_epoch_get() waits for its last users
+ * to put it before returning the new table. A thread must therefore not
+ * get the table while it still holds it.
+ *
+ * The epoch takes ownership of @teval. Only one thread may swap and
+ * release, and the table returned by a swap must be released, not
+ * freed.
+ */
+struct traceeval_epoch *traceeval_epoch_alloc(struct traceeval *teval)
+{
+	struct traceeval_epoch *epoch;
+
+	epoch = calloc(1, sizeof(*epoch));
+	if (!epoch)
+		return NULL;
+
+	epoch->standby = trace_eval_alloc_like(teval);
+	if (!epoch->standby) {
+		free(epoch);
+		return NULL;
+	}
+	epoch->current = teval;
+
+	return epoch;
+}
+
+/* Frees the tables owned by @epoch, but not one taken by a swap */
+void traceeval_epoch_free(struct traceeval_epoch *epoch)
+{
+	if (!epoch)
+		return;
+
+	traceeval_free(epoch->current);
+	traceeval_free(epoch->standby);
+	free(epoch);
+}
+
+struct traceeval *traceeval_epoch_get(struct traceeval_epoch *epoch)
+{
+	struct traceeval *teval;
+
+	struct traceeval *carry;
+
+	for (;;) {
+		teval = __atomic_load_n(&epoch->current, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&teval->users, 1, __ATOMIC_SEQ_CST);
+
+		/* Make sure a swap did not happen before users was updated */
+		if (__atomic_load_n(&epoch->current, __ATOMIC_SEQ_CST) == teval) {
+			/* Started intervals are carried once the last epoch is done */
+			carry = teval->carry;
+			while (carry && __atomic_load_n(&carry->users, __ATOMIC_ACQUIRE))
+				sched_yield();
+			return teval;
+		}
+
+		__atomic_sub_fetch(&teval->users, 1, __ATOMIC_RELEASE);
+	}
+}
+
+void traceeval_epoch_put(struct traceeval_epoch *epoch, struct traceeval *teval)
+{
+	__atomic_sub_fetch(&teval->users, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start a new epoch and return the table of the previous one, after all
+ * users of it have called traceeval_epoch_put(). Returns NULL with errno
+ * set to EBUSY if the table returned by the last swap was not released.
+ */
+struct traceeval *traceeval_epoch_swap(struct traceeval_epoch *epoch)
+{
+	struct traceeval *prev;
+	struct traceeval *next;
+
+	if (!epoch->standby) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	prev = epoch->current;
+	next = epoch->standby;
+
+	/* Set up before the ingest side can see @next */
+	next->carry = prev;
+	next->epoch = ++epoch->nr_swaps;
+
+	__atomic_store_n(&epoch->current, next, __ATOMIC_SEQ_CST);
+	epoch->standby = NULL;
+	epoch->swapped = prev;
+
+	while (__atomic_load_n(&prev->users, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	return prev;
+}
+
+int traceeval_epoch_release(struct traceeval_epoch *epoch, struct traceeval *teval)
+{
+	if (!teval || teval != epoch->swapped)
+		return -1;
+
+	/* Keep the intervals still started, they are carried from here */
+	reset_metrics(teval, false);
+	epoch->standby = teval;
+	epoch->swapped = NULL;
+
+	return 0;
+}
+
+struct sort_data {
+	struct traceeval	*teval;
+	int			metric;
+	bool			ascending;
+	int (*cmp)(const void *A, const void *B, void *data);
+};
+
+static int cmp_totals(const void *A, const void *B, void *data)
 {
 	const struct eval_instance *a = A;
 	const struct eval_instance *b = B;
+	struct sort_data *sdata = data;
+	const struct eval_metric *am = &a->metrics[sdata->metric];
+	const struct eval_metric *bm = &b->metrics[sdata->metric];
 
-	if (a->max < b->max)
+	if (am->total < bm->total)
 		return -1;
-	return a->max > b->max;
+	return am->total > bm->total;
 }
 
-static int cmp_min(const void *A, const void *B)
+static int cmp_max(const void *A, const void *B, void *data)
 {
 	const struct eval_instance *a = A;
 	const struct eval_instance *b = B;
+	struct sort_data *sdata = data;
+	const struct eval_metric *am = &a->metrics[sdata->metric];
+	const struct eval_metric *bm = &b->metrics[sdata->metric];
 
-	if (a->min < b->min)
+	if (am->max < bm->max)
 		return -1;
-	return a->min > b->min;
+	return am->max > bm->max;
 }
 
-static int cmp_cnt(const void *A, const void *B)
+static int cmp_min(const void *A, const void *B, void *data)
 {
 	const struct eval_instance *a = A;
 	const struct eval_instance *b = B;
+	struct sort_data *sdata = data;
+	const struct eval_metric *am = &a->metrics[sdata->metric];
+	const struct eval_metric *bm = &b->metrics[sdata->metric];
 
-	if (a->cnt < b->cnt)
+	if (am->min < bm->min)
 		return -1;
-	return a->cnt > b->cnt;
+	return am->min > bm->min;
 }
 
-static int cmp_inverse(const void *A, const void *B, void *cmp)
+static int cmp_cnt(const void *A, const void *B, void *data)
 {
-	int (*cmp_func)(const void *, const void *) = cmp;
+	const struct eval_instance *a = A;
+	const struct eval_instance *b = B;
+	struct sort_data *sdata = data;
+	const struct eval_metric *am = &a->metrics[sdata->metric];
+	const struct eval_metric *bm = &b->metrics[sdata->metric];
 
-	return cmp_func(B, A);
+	if (am->cnt < bm->cnt)
+		return -1;
+	return am->cnt > bm->cnt;
 }
 
 static int cmp_evals(const void *A, const void *B, void *data)
 {
 	const struct eval_instance *a = A;
 	const struct eval_instance *b = B;
-	struct traceeval *teval = data;
+	struct sort_data *sdata = data;
 	int err;
 
-	return cmp_keys(&teval->array, a->keys, b->keys, &err);
+	return cmp_keys(&sdata->teval->array, a->keys, b->keys, &err);
 }
 
-static int cmp_evals_dec(const void *A, const void *B, void *data)
+/* Ties are ordered by the keys, which are unique, to make the order total */
+static int cmp_results(const void *A, const void *B, void *data)
 {
-	struct traceeval *teval = data;
-	int err;
+	struct sort_data *sdata = data;
+	int ret;
 
-	return cmp_keys(&teval->array, B, A, &err);
+	if (sdata->ascending)
+		ret = sdata->cmp(A, B, data);
+	else
+		ret = sdata->cmp(B, A, data);
+
+	if (ret || sdata->cmp == cmp_evals)
+		return ret;
+
+	return cmp_evals(A, B, data);
 }
 
-static int eval_sort(struct traceeval *teval, enum sort_type sort_type, bool ascending)
+#ifndef TRACEEVAL_NO_COUNTERS
+static unsigned long long get_time_ns(void)
 {
-	int (*cmp_func)(const void *, const void *);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* Sort @base of @teval->nr_evals elements, with threads if it is large */
+static void sort_array(struct traceeval *teval, void *base, size_t size,
+		       int (*cmp)(const void *, const void *, void *), void *data)
+{
+#ifndef TRACEEVAL_NO_COUNTERS
+	unsigned long long start = get_time_ns();
+#endif
+
+	if (teval->nr_evals >= teval->sort_threshold && teval->sort_threads != 1) {
+		trace_eval_sort(base, teval->nr_evals, size, cmp, data,
+				teval->sort_threads);
+	} else {
+		qsort_r(base, teval->nr_evals, size, cmp, data);
+	}
+
+	eval_count(teval, nr_sorts, 1);
+	eval_count(teval, sort_ns, get_time_ns() - start);
+}
+
+static void sort_results(struct traceeval *teval,
+			 int (*cmp)(const void *, const void *, void *), void *data)
+{
+	sort_array(teval, teval->results, sizeof(*teval->results), cmp, data);
+}
+
+static int eval_sort(struct traceeval *teval, enum sort_type sort_type,
+		     int metric, bool ascending)
+{
+	struct sort_data sdata = {
+		.teval = teval,
+		.metric = metric,
+		.ascending = ascending,
+	};
+
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return -1;
 
 	if (create_results(teval) < 0)
 		return -1;
 
-	if (teval->sort_type == sort_type)
+	if (teval->sort_type == sort_type && teval->sort_metric == metric &&
+	    teval->sort_ascending == ascending)
 		return 0;
 
 	switch (sort_type) {
 	case TOTALS:
-		cmp_func = cmp_totals;
+		sdata.cmp = cmp_totals;
 		break;
 	case MAX:
-		cmp_func = cmp_max;
+		sdata.cmp = cmp_max;
 		break;
 	case MIN:
-		cmp_func = cmp_min;
+		sdata.cmp = cmp_min;
 		break;
 	case CNT:
-		cmp_func = cmp_cnt;
+		sdata.cmp = cmp_cnt;
 		break;
 	case NONE:
 	case KEYS:
-		if (ascending) {
-			qsort_r(teval->results, teval->nr_evals,
-				sizeof(*teval->results), cmp_evals, teval);
-		} else {
-			qsort_r(teval->results, teval->nr_evals,
-				sizeof(*teval->results), cmp_evals_dec, teval);
-		}
-		return 0;
+		sdata.cmp = cmp_evals;
+		break;
 	}
 
-	if (ascending)
-		qsort(teval->results, teval->nr_evals, sizeof(*teval->results), cmp_func);
-	else
-		qsort_r(teval->results, teval->nr_evals, sizeof(*teval->results),
-			cmp_inverse, cmp_func);
+	sort_results(teval, cmp_results, &sdata);
 	teval->sort_type = sort_type;
+	teval->sort_metric = metric;
+	teval->sort_ascending = ascending;
 	return 0;
 }
 
+int traceeval_sort_metric_totals(struct traceeval *teval, int metric, bool ascending)
+{
+	return eval_sort(teval, TOTALS, metric, ascending);
+}
+
+int traceeval_sort_metric_max(struct traceeval *teval, int metric, bool ascending)
+{
+	return eval_sort(teval, MAX, metric, ascending);
+}
+
+int traceeval_sort_metric_min(struct traceeval *teval, int metric, bool ascending)
+{
+	return eval_sort(teval, MIN, metric, ascending);
+}
+
+int traceeval_sort_metric_cnt(struct traceeval *teval, int metric, bool ascending)
+{
+	return eval_sort(teval, CNT, metric, ascending);
+}
+
 int traceeval_sort_totals(struct traceeval *teval, bool ascending)
 {
-	return eval_sort(teval, TOTALS, ascending);
+	return eval_sort(teval, TOTALS, 0, ascending);
 }
 
 int traceeval_sort_max(struct traceeval *teval, bool ascending)
 {
-	return eval_sort(teval, MAX, ascending);
+	return eval_sort(teval, MAX, 0, ascending);
 }
 
 int traceeval_sort_min(struct traceeval *teval, bool ascending)
 {
-	return eval_sort(teval, MIN, ascending);
+	return eval_sort(teval, MIN, 0, ascending);
 }
 
 int traceeval_sort_cnt(struct traceeval *teval, bool ascending)
 {
-	return eval_sort(teval, CNT, ascending);
+	return eval_sort(teval, CNT, 0, ascending);
 }
 
 struct cmp_data {
@@ -783,9 +1995,17 @@ static int cmp_custom(const void *A, const void *B, void *data)
 {
 	const struct traceeval_key_array *a = A;
 	const struct traceeval_key_array *b = B;
+	const struct eval_instance *ea = A;
+	const struct eval_instance *eb = B;
 	struct cmp_data *cdata = data;
+	int ret;
+	int err;
+
+	ret = cdata->func(cdata->teval, a, b, cdata->data);
+	if (ret)
+		return ret;
 
-	return cdata->func(cdata->teval, a, b, cdata->data);
+	return cmp_keys(&cdata->teval->array, ea->keys, eb->keys, &err);
 }
 
 int traceeval_sort_custom(struct traceeval *teval, traceeval_cmp_func cmp, void *data)
@@ -799,13 +2019,300 @@ int traceeval_sort_custom(struct traceeval *teval, traceeval_cmp_func cmp, void
 	cdata.func = cmp;
 	cdata.data = data;
 
-	qsort_r(teval->results, teval->nr_evals,
-		sizeof(*teval->results), cmp_custom, &cdata);
+	sort_results(teval, cmp_custom, &cdata);
+
+	/* The order is not one that eval_sort() can reuse */
+	teval->sort_type = NONE;
 
 	return 0;
 }
 
 int traceeval_sort_keys(struct traceeval *teval, bool ascending)
 {
-	return eval_sort(teval, KEYS, ascending);
+	return eval_sort(teval, KEYS, 0, ascending);
+}
+
+/*
+ * Sort results of @threshold entries or more with @nr_threads threads.
+ * A @nr_threads of zero uses one thread per online CPU, and larger
+ * counts are capped at the online CPU count. One disables the threaded
+ * sort. The order is the same as the single threaded sort, as ties are
+ * always broken on the keys. A custom compare function passed to
+ * traceeval_sort_custom() must be thread safe.
+ */
+int traceeval_set_sort_threads(struct traceeval *teval, int nr_threads, size_t threshold)
+{
+	if (nr_threads < 0)
+		return -1;
+
+	teval->sort_threads = nr_threads;
+	teval->sort_threshold = threshold;
+	return 0;
+}
+
+int traceeval_get_stats(struct traceeval *teval, struct traceeval_stats *stats)
+{
+	struct eval_index_entry *entry;
+	struct eval_index *index;
+	struct eval_hash *ehash;
+	size_t chain;
+	int i, x;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->nr_entries = teval->nr_evals;
+	stats->nr_buckets = HASH_SIZE;
+	stats->load_factor = (double)teval->nr_evals / HASH_SIZE;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		chain = 0;
+		for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next)
+			chain++;
+		if (!chain)
+			continue;
+		stats->used_buckets++;
+		if (chain > stats->max_chain)
+			stats->max_chain = chain;
+	}
+	if (stats->used_buckets)
+		stats->avg_chain = (double)teval->nr_evals / stats->used_buckets;
+
+	stats->lookups = teval->counters.lookups;
+	stats->misses = teval->counters.misses;
+	stats->probes = teval->counters.probes;
+	stats->inserts = teval->counters.inserts;
+	stats->nr_sorts = teval->counters.nr_sorts;
+	stats->sort_ns = teval->counters.sort_ns;
+
+	stats->table_bytes = sizeof(*teval) +
+		sizeof(*teval->array.keys) * teval->array.nr_keys;
+	stats->entry_bytes = teval->nr_evals *
+		(sizeof(*ehash) + sizeof(*ehash->metrics) * teval->nr_metrics);
+	stats->key_bytes = teval->nr_evals *
+		sizeof(*ehash->eval.keys) * teval->array.nr_keys;
+
+	/* Stacks of nested starts that outgrew the metric */
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next) {
+			for (x = 0; x < teval->nr_metrics; x++)
+				stats->entry_bytes += sizeof(*ehash->metrics[x].spill) *
+					ehash->metrics[x].spill_size;
+		}
+	}
+
+	if (teval->copy_strings) {
+		for (i = 0; i < HASH_SIZE; i++) {
+			for (ehash = teval->eval_hash[i]; ehash; ehash = ehash->next) {
+				for (x = 0; x < ehash->eval.nr_keys; x++) {
+					if (ehash->eval.keys[x].type == TRACEEVAL_TYPE_STRING)
+						stats->key_bytes +=
+							strlen(ehash->eval.keys[x].string) + 1;
+				}
+			}
+		}
+	}
+	if (teval->results)
+		stats->result_bytes = teval->nr_evals * sizeof(*teval->results);
+
+	for (x = 0; x < teval->nr_indexes; x++) {
+		index = teval->indexes[x];
+		stats->index_bytes += sizeof(*index);
+		for (i = 0; i < HASH_SIZE; i++) {
+			for (entry = index->hash[i]; entry; entry = entry->next) {
+				stats->index_bytes += sizeof(*entry) +
+					sizeof(*entry->keys) * index->array.nr_keys +
+					sizeof(*entry->evals) * entry->size;
+			}
+		}
+	}
+
+	return 0;
+}
+
+struct spec_data {
+	size_t			nr_cols;
+	/* For string columns: 1 if ascending, -1 if descending, else 0 */
+	int			*strings;
+	bool			has_strings;
+};
+
+/*
+ * A sort record is the values of the spec columns, then the values of
+ * all the keys to break ties, followed by the index of the result.
+ * Numeric values are stored inverted for descending columns, so they
+ * all compare the same way. String columns hold the string pointer.
+ */
+static int cmp_spec(const void *A, const void *B, void *data)
+{
+	const unsigned long long *a = A;
+	const unsigned long long *b = B;
+	struct spec_data *sd = data;
+	int ret;
+	int i;
+
+	for (i = 0; i < sd->nr_cols; i++) {
+		if (sd->has_strings && sd->strings[i]) {
+			ret = strcmp((const char *)(unsigned long)a[i],
+				     (const char *)(unsigned long)b[i]);
+			if (ret)
+				return ret * sd->strings[i];
+			continue;
+		}
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+static int spec_key_value(const struct traceeval_key *key, unsigned long long *val)
+{
+	switch (key->type) {
+	case TRACEEVAL_TYPE_STRING:
+		*val = (unsigned long)key->string;
+		return 0;
+	case TRACEEVAL_TYPE_NUMBER:
+		*val = key->number;
+		return 0;
+	case TRACEEVAL_TYPE_NUMBER_64:
+		*val = key->number_64;
+		return 0;
+	case TRACEEVAL_TYPE_NUMBER_32:
+		*val = key->number_32;
+		return 0;
+	case TRACEEVAL_TYPE_NUMBER_16:
+		*val = key->number_16;
+		return 0;
+	case TRACEEVAL_TYPE_NUMBER_8:
+		*val = key->number_8;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Sort the results by the columns described in @spec, in order. Instead
+ * of calling a compare function that goes through the instances, a
+ * record holding the values of all the columns is built up front for
+ * every result, and the records are sorted. Ties on all the columns are
+ * broken on the keys, like the other sorts.
+ */
+int traceeval_sort_spec(struct traceeval *teval, const struct traceeval_sort_spec *spec,
+			size_t nr_specs)
+{
+	size_t nr_keys = teval->array.nr_keys;
+	struct spec_data sd = {
+		.nr_cols = nr_specs + nr_keys,
+	};
+	struct eval_instance *results = NULL;
+	unsigned long long *recs = NULL;
+	const struct eval_metric *metric;
+	unsigned long long *rec;
+	unsigned long long val;
+	size_t rec_size;
+	size_t i;
+	int c;
+
+	if (!nr_specs)
+		return -1;
+
+	sd.strings = calloc(sd.nr_cols, sizeof(*sd.strings));
+	if (!sd.strings)
+		return -1;
+
+	for (c = 0; c < nr_keys; c++) {
+		if (teval->array.keys[c].type == TRACEEVAL_TYPE_STRING) {
+			sd.strings[nr_specs + c] = 1;
+			sd.has_strings = true;
+		}
+	}
+
+	for (c = 0; c < nr_specs; c++) {
+		switch (spec[c].field) {
+		case TRACEEVAL_SORT_KEY:
+			if (spec[c].index < 0 || spec[c].index >= teval->array.nr_keys)
+				goto fail;
+			if (teval->array.keys[spec[c].index].type == TRACEEVAL_TYPE_STRING) {
+				sd.strings[c] = spec[c].ascending ? 1 : -1;
+				sd.has_strings = true;
+			}
+			break;
+		case TRACEEVAL_SORT_TOTAL:
+		case TRACEEVAL_SORT_MAX:
+		case TRACEEVAL_SORT_MIN:
+		case TRACEEVAL_SORT_CNT:
+			if (spec[c].index < 0 || spec[c].index >= teval->nr_metrics)
+				goto fail;
+			break;
+		default:
+			goto fail;
+		}
+	}
+
+	if (create_results(teval) < 0)
+		goto fail;
+
+	rec_size = sizeof(*recs) * (sd.nr_cols + 1);
+	recs = malloc(rec_size * teval->nr_evals);
+	results = malloc(sizeof(*results) * teval->nr_evals);
+	if (!recs || !results)
+		goto fail;
+
+	for (i = 0; i < teval->nr_evals; i++) {
+		rec = recs + i * (sd.nr_cols + 1);
+
+		for (c = 0; c < nr_specs; c++) {
+			if (spec[c].field == TRACEEVAL_SORT_KEY) {
+				if (spec_key_value(&teval->results[i].keys[spec[c].index],
+						   &val) < 0)
+					goto fail;
+				if (sd.strings[c]) {
+					rec[c] = val;
+					continue;
+				}
+			} else {
+				metric = &teval->results[i].metrics[spec[c].index];
+				switch (spec[c].field) {
+				case TRACEEVAL_SORT_TOTAL:
+					val = metric->total;
+					break;
+				case TRACEEVAL_SORT_MAX:
+					val = metric->max;
+					break;
+				case TRACEEVAL_SORT_MIN:
+					val = metric->min;
+					break;
+				default:
+					val = metric->cnt;
+					break;
+				}
+			}
+			rec[c] = spec[c].ascending ? val : ~val;
+		}
+		for (c = 0; c < nr_keys; c++) {
+			if (spec_key_value(&teval->results[i].keys[c], &rec[nr_specs + c]) < 0)
+				goto fail;
+		}
+		rec[sd.nr_cols] = i;
+	}
+
+	sort_array(teval, recs, rec_size, cmp_spec, &sd);
+
+	for (i = 0; i < teval->nr_evals; i++)
+		results[i] = teval->results[recs[i * (sd.nr_cols + 1) + sd.nr_cols]];
+
+	free(teval->results);
+	teval->results = results;
+
+	/* The order is not one that eval_sort() can reuse */
+	teval->sort_type = NONE;
+
+	free(recs);
+	free(sd.strings);
+	return 0;
+ fail:
+	free(results);
+	free(recs);
+	free(sd.strings);
+	return -1;
 }
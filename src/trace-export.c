@@ -0,0 +1,718 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2022 Google Inc, Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "traceeval-local.h"
+
+#define EXPORT_CHUNK		(1 << 20)
+/* Chunks formatted before they are written out */
+#define EXPORT_FLUSH		16
+
+#define EXPORT_MAGIC		"TEVALBIN"
+#define EXPORT_VERSION		1
+
+/* Chunks handed from the formatting thread to the writing thread */
+struct export_queue {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct iovec		iov[EXPORT_FLUSH];
+	size_t			nr_iov;
+	bool			done;
+	int			fd;
+	int			ret;
+};
+
+struct export_buf {
+	struct iovec		*iov;
+	size_t			nr_iov;
+	size_t			size_iov;
+	/* If set, chunks are queued for a writer instead of written */
+	struct export_queue	*queue;
+	int			fd;
+	int			ret;
+};
+
+struct export_stat {
+	unsigned long long	cnt;
+	unsigned long long	total;
+	unsigned long long	max;
+	unsigned long long	min;
+};
+
+/* The rows to export: either the results, or a snapshot of them */
+struct export_rows {
+	size_t				nr_rows;
+	struct eval_instance		*results;
+	const struct traceeval_key	**keys;
+	struct export_stat		*stats;
+};
+
+struct traceeval_export {
+	struct traceeval		*teval;
+	enum traceeval_export_format	format;
+	struct export_rows		rows;
+	struct export_buf		buf;
+	struct export_queue		queue;
+	pthread_t			format_thread;
+	pthread_t			write_thread;
+};
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int write_iov(int fd, const struct iovec *iov, size_t nr)
+{
+	ssize_t ret;
+
+	while (nr) {
+		ret = writev(fd, iov, nr < IOV_MAX ? nr : IOV_MAX);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (nr && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+
+		/* Finish a chunk that was partially written */
+		if (nr && ret) {
+			if (write_all(fd, (char *)iov->iov_base + ret, iov->iov_len - ret) < 0)
+				return -1;
+			iov++;
+			nr--;
+		}
+	}
+	return 0;
+}
+
+static void free_chunks(struct export_buf *buf)
+{
+	size_t i;
+
+	for (i = 0; i < buf->nr_iov; i++)
+		free(buf->iov[i].iov_base);
+	buf->nr_iov = 0;
+}
+
+/* Wait for the writer to take the chunks queued before, then queue these */
+static int queue_chunks(struct export_buf *buf)
+{
+	struct export_queue *queue = buf->queue;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->nr_iov && !queue->ret)
+		pthread_cond_wait(&queue->cond, &queue->lock);
+
+	if (queue->ret < 0)
+		buf->ret = -1;
+
+	if (buf->ret == 0) {
+		memcpy(queue->iov, buf->iov, sizeof(*buf->iov) * buf->nr_iov);
+		queue->nr_iov = buf->nr_iov;
+		buf->nr_iov = 0;
+		pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	free_chunks(buf);
+	return buf->ret;
+}
+
+static int flush_buf(struct export_buf *buf)
+{
+	if (buf->queue)
+		return queue_chunks(buf);
+
+	if (buf->ret == 0 && write_iov(buf->fd, buf->iov, buf->nr_iov) < 0)
+		buf->ret = -1;
+
+	free_chunks(buf);
+	return buf->ret;
+}
+
+/* Return room for @len bytes at the end of the current chunk */
+static char *buf_reserve(struct export_buf *buf, size_t len)
+{
+	struct iovec *iov;
+	char *chunk;
+
+	if (buf->ret < 0)
+		return NULL;
+
+	if (buf->nr_iov) {
+		iov = &buf->iov[buf->nr_iov - 1];
+		if (iov->iov_len + len <= EXPORT_CHUNK)
+			return (char *)iov->iov_base + iov->iov_len;
+	}
+
+	if (buf->nr_iov == EXPORT_FLUSH && flush_buf(buf) < 0)
+		return NULL;
+
+	if (buf->nr_iov == buf->size_iov) {
+		size_t size = buf->size_iov ? buf->size_iov * 2 : EXPORT_FLUSH;
+
+		iov = realloc(buf->iov, sizeof(*iov) * size);
+		if (!iov)
+			goto fail;
+		buf->iov = iov;
+		buf->size_iov = size;
+	}
+
+	chunk = malloc(len > EXPORT_CHUNK ? len : EXPORT_CHUNK);
+	if (!chunk)
+		goto fail;
+
+	iov = &buf->iov[buf->nr_iov++];
+	iov->iov_base = chunk;
+	iov->iov_len = 0;
+
+	return iov->iov_base;
+ fail:
+	buf->ret = -1;
+	return NULL;
+}
+
+static void buf_commit(struct export_buf *buf, size_t len)
+{
+	buf->iov[buf->nr_iov - 1].iov_len += len;
+}
+
+static void buf_add(struct export_buf *buf, const void *data, size_t len)
+{
+	char *p = buf_reserve(buf, len);
+
+	if (!p)
+		return;
+	memcpy(p, data, len);
+	buf_commit(buf, len);
+}
+
+/* snprintf() is too slow for the amount of numbers written */
+static char *put_u64(char *p, unsigned long long val)
+{
+	char tmp[20];
+	int i = 0;
+
+	do {
+		tmp[i++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	while (i)
+		*p++ = tmp[--i];
+	return p;
+}
+
+static char *put_s64(char *p, long long val)
+{
+	if (val < 0) {
+		*p++ = '-';
+		return put_u64(p, -(unsigned long long)val);
+	}
+	return put_u64(p, val);
+}
+
+static void csv_add_string(struct export_buf *buf, const char *str)
+{
+	const char *s;
+	char *start;
+	char *p;
+
+	if (!str)
+		return;
+
+	if (!strpbrk(str, ",\"\n\r")) {
+		buf_add(buf, str, strlen(str));
+		return;
+	}
+
+	/* Quote the string and double the quotes within it */
+	start = p = buf_reserve(buf, strlen(str) * 2 + 2);
+	if (!p)
+		return;
+
+	*p++ = '"';
+	for (s = str; *s; s++) {
+		if (*s == '"')
+			*p++ = '"';
+		*p++ = *s;
+	}
+	*p++ = '"';
+	buf_commit(buf, p - start);
+}
+
+static char *csv_put_key(char *p, const struct traceeval_key *key)
+{
+	switch (key->type) {
+	case TRACEEVAL_TYPE_NUMBER:
+		return put_s64(p, key->number);
+	case TRACEEVAL_TYPE_NUMBER_64:
+		return put_u64(p, key->number_64);
+	case TRACEEVAL_TYPE_NUMBER_32:
+		return put_u64(p, key->number_32);
+	case TRACEEVAL_TYPE_NUMBER_16:
+		return put_u64(p, key->number_16);
+	case TRACEEVAL_TYPE_NUMBER_8:
+		return put_u64(p, key->number_8);
+	case TRACEEVAL_TYPE_POINTER:
+		return put_u64(p, (unsigned long)key->pointer);
+	default:
+		return p;
+	}
+}
+
+static const char *stat_names[] = { "cnt", "total", "max", "min" };
+
+static const struct traceeval_key *row_keys(const struct export_rows *rows, size_t i)
+{
+	return rows->keys ? rows->keys[i] : rows->results[i].keys;
+}
+
+static void row_stat(struct traceeval *teval, const struct export_rows *rows,
+		     size_t i, int m, struct export_stat *stat)
+{
+	struct eval_metric *metric;
+
+	if (rows->stats) {
+		*stat = rows->stats[i * teval->nr_metrics + m];
+		return;
+	}
+
+	metric = &rows->results[i].metrics[m];
+	stat->cnt = metric->cnt;
+	stat->total = metric->total;
+	stat->max = metric->max;
+	stat->min = metric->min;
+}
+
+static void export_csv(struct traceeval *teval, const struct export_rows *rows,
+		       struct export_buf *buf)
+{
+	const struct traceeval_key *keys;
+	struct export_stat stat;
+	const char *name;
+	char num[32];
+	char *start;
+	size_t i;
+	int k, m, s;
+	char *p;
+
+	for (k = 0; k < teval->array.nr_keys; k++) {
+		if (k)
+			buf_add(buf, ",", 1);
+		name = teval->array.keys[k].name;
+		if (name) {
+			csv_add_string(buf, name);
+		} else {
+			p = put_u64(stpcpy(num, "key"), k);
+			buf_add(buf, num, p - num);
+		}
+	}
+
+	for (m = 0; m < teval->nr_metrics; m++) {
+		for (s = 0; s < 4; s++) {
+			buf_add(buf, ",", 1);
+			/* A single metric keeps the plain stat names */
+			if (teval->nr_metrics > 1) {
+				name = teval->metric_names ? teval->metric_names[m] : NULL;
+				if (name) {
+					csv_add_string(buf, name);
+				} else {
+					p = put_u64(stpcpy(num, "metric"), m);
+					buf_add(buf, num, p - num);
+				}
+				buf_add(buf, "_", 1);
+			}
+			buf_add(buf, stat_names[s], strlen(stat_names[s]));
+		}
+	}
+	buf_add(buf, "\n", 1);
+
+	for (i = 0; i < rows->nr_rows; i++) {
+		keys = row_keys(rows, i);
+
+		for (k = 0; k < teval->array.nr_keys; k++) {
+			if (k)
+				buf_add(buf, ",", 1);
+			if (keys[k].type == TRACEEVAL_TYPE_STRING) {
+				csv_add_string(buf, keys[k].string);
+				continue;
+			}
+			p = buf_reserve(buf, 21);
+			if (!p)
+				return;
+			buf_commit(buf, csv_put_key(p, &keys[k]) - p);
+		}
+
+		/* 4 numbers of up to 20 digits and their commas per metric */
+		start = p = buf_reserve(buf, teval->nr_metrics * 84 + 1);
+		if (!p)
+			return;
+
+		for (m = 0; m < teval->nr_metrics; m++) {
+			row_stat(teval, rows, i, m, &stat);
+			*p++ = ',';
+			p = put_u64(p, stat.cnt);
+			*p++ = ',';
+			p = put_u64(p, stat.total);
+			*p++ = ',';
+			p = put_u64(p, stat.max);
+			*p++ = ',';
+			p = put_u64(p, stat.min);
+		}
+		*p++ = '\n';
+		buf_commit(buf, p - start);
+	}
+}
+
+static void bin_add_u32(struct export_buf *buf, unsigned int val)
+{
+	buf_add(buf, &val, sizeof(val));
+}
+
+static void bin_add_u64(struct export_buf *buf, unsigned long long val)
+{
+	buf_add(buf, &val, sizeof(val));
+}
+
+static void bin_add_name(struct export_buf *buf, const char *name)
+{
+	unsigned int len = name ? strlen(name) : 0;
+
+	bin_add_u32(buf, len);
+	if (len)
+		buf_add(buf, name, len);
+}
+
+static unsigned long long bin_key_value(const struct traceeval_key *key)
+{
+	switch (key->type) {
+	case TRACEEVAL_TYPE_NUMBER:
+		return key->number;
+	case TRACEEVAL_TYPE_NUMBER_64:
+		return key->number_64;
+	case TRACEEVAL_TYPE_NUMBER_32:
+		return key->number_32;
+	case TRACEEVAL_TYPE_NUMBER_16:
+		return key->number_16;
+	case TRACEEVAL_TYPE_NUMBER_8:
+		return key->number_8;
+	case TRACEEVAL_TYPE_POINTER:
+		return (unsigned long)key->pointer;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The binary format is in host byte order:
+ *
+ *  "TEVALBIN", u32 version, u32 nr_keys, u32 nr_metrics, u32 reserved,
+ *  u64 nr_rows, then for each key: u32 type and a name, and for each
+ *  metric: a name. A name is a u32 length followed by its bytes.
+ *
+ * Then come the columns, each for all the rows: for every key, either
+ * u64 values, or for strings u32 lengths followed by all the bytes; then
+ * for every metric the u64 cnt, total, max and min columns.
+ */
+static void export_binary(struct traceeval *teval, const struct export_rows *rows,
+			  struct export_buf *buf)
+{
+	unsigned long long nr_rows = rows->nr_rows;
+	struct export_stat stat;
+	const char *str;
+	size_t i;
+	int k, m, s;
+
+	buf_add(buf, EXPORT_MAGIC, 8);
+	bin_add_u32(buf, EXPORT_VERSION);
+	bin_add_u32(buf, teval->array.nr_keys);
+	bin_add_u32(buf, teval->nr_metrics);
+	bin_add_u32(buf, 0);
+	bin_add_u64(buf, nr_rows);
+
+	for (k = 0; k < teval->array.nr_keys; k++) {
+		bin_add_u32(buf, teval->array.keys[k].type);
+		bin_add_name(buf, teval->array.keys[k].name);
+	}
+	for (m = 0; m < teval->nr_metrics; m++)
+		bin_add_name(buf, teval->metric_names ? teval->metric_names[m] : NULL);
+
+	for (k = 0; k < teval->array.nr_keys; k++) {
+		if (teval->array.keys[k].type == TRACEEVAL_TYPE_STRING) {
+			for (i = 0; i < nr_rows; i++) {
+				str = row_keys(rows, i)[k].string;
+				bin_add_u32(buf, str ? strlen(str) : 0);
+			}
+			for (i = 0; i < nr_rows; i++) {
+				str = row_keys(rows, i)[k].string;
+				if (str)
+					buf_add(buf, str, strlen(str));
+			}
+			continue;
+		}
+
+		for (i = 0; i < nr_rows; i++)
+			bin_add_u64(buf, bin_key_value(&row_keys(rows, i)[k]));
+	}
+
+	for (m = 0; m < teval->nr_metrics; m++) {
+		for (s = 0; s < 4; s++) {
+			for (i = 0; i < nr_rows; i++) {
+				row_stat(teval, rows, i, m, &stat);
+				switch (s) {
+				case 0:
+					bin_add_u64(buf, stat.cnt);
+					break;
+				case 1:
+					bin_add_u64(buf, stat.total);
+					break;
+				case 2:
+					bin_add_u64(buf, stat.max);
+					break;
+				default:
+					bin_add_u64(buf, stat.min);
+					break;
+				}
+			}
+		}
+	}
+}
+
+static int export_format(struct traceeval *teval, const struct export_rows *rows,
+			 struct export_buf *buf, enum traceeval_export_format format)
+{
+	switch (format) {
+	case TRACEEVAL_EXPORT_CSV:
+		export_csv(teval, rows, buf);
+		break;
+	case TRACEEVAL_EXPORT_BINARY:
+		export_binary(teval, rows, buf);
+		break;
+	default:
+		return -1;
+	}
+	return buf->ret;
+}
+
+/*
+ * Write every result of @teval, in the current sort order (by keys if
+ * the results were never sorted), to @fd as CSV or in the binary columnar
+ * format. The rows are formatted into large chunks that are written with
+ * writev() every EXPORT_FLUSH chunks.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int traceeval_export(struct traceeval *teval, int fd,
+		     enum traceeval_export_format format)
+{
+	struct export_buf buf = {
+		.fd = fd,
+	};
+	struct export_rows rows;
+	int ret;
+
+	if (trace_eval_get_results(teval) < 0)
+		return -1;
+
+	memset(&rows, 0, sizeof(rows));
+	rows.nr_rows = teval->nr_evals;
+	rows.results = teval->results;
+
+	ret = export_format(teval, &rows, &buf, format);
+	if (ret == 0)
+		ret = flush_buf(&buf);
+
+	free_chunks(&buf);
+	free(buf.iov);
+	return ret;
+}
+
+/*
+ * Copy the stats of the results, so that they can be formatted while
+ * @teval is updated. The keys of an instance never change once it is
+ * created, so only a pointer to them is kept.
+ */
+static int snapshot_rows(struct traceeval *teval, struct export_rows *rows)
+{
+	struct eval_metric *metric;
+	struct export_stat *stat;
+	size_t nr = teval->nr_evals;
+	size_t i;
+	int m;
+
+	rows->nr_rows = nr;
+	rows->keys = malloc(sizeof(*rows->keys) * (nr ? nr : 1));
+	rows->stats = malloc(sizeof(*rows->stats) * (nr ? nr : 1) * teval->nr_metrics);
+	if (!rows->keys || !rows->stats)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		rows->keys[i] = teval->results[i].keys;
+		for (m = 0; m < teval->nr_metrics; m++) {
+			metric = &teval->results[i].metrics[m];
+			stat = &rows->stats[i * teval->nr_metrics + m];
+			stat->cnt = metric->cnt;
+			stat->total = metric->total;
+			stat->max = metric->max;
+			stat->min = metric->min;
+		}
+	}
+	return 0;
+}
+
+static void *write_thread(void *data)
+{
+	struct export_queue *queue = data;
+	struct iovec iov[EXPORT_FLUSH];
+	bool failed = false;
+	size_t nr, i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		while (!queue->nr_iov && !queue->done)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+
+		nr = queue->nr_iov;
+		memcpy(iov, queue->iov, sizeof(*iov) * nr);
+		queue->nr_iov = 0;
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->lock);
+
+		if (!nr)
+			break;
+
+		if (!failed && write_iov(queue->fd, iov, nr) < 0) {
+			failed = true;
+			pthread_mutex_lock(&queue->lock);
+			queue->ret = -1;
+			pthread_cond_broadcast(&queue->cond);
+			pthread_mutex_unlock(&queue->lock);
+		}
+
+		for (i = 0; i < nr; i++)
+			free(iov[i].iov_base);
+	}
+	return NULL;
+}
+
+static void *format_thread(void *data)
+{
+	struct traceeval_export *export = data;
+	struct export_queue *queue = &export->queue;
+
+	if (export_format(export->teval, &export->rows, &export->buf, export->format) == 0)
+		flush_buf(&export->buf);
+	free_chunks(&export->buf);
+
+	pthread_mutex_lock(&queue->lock);
+	queue->done = true;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+static void free_export(struct traceeval_export *export)
+{
+	pthread_cond_destroy(&export->queue.cond);
+	pthread_mutex_destroy(&export->queue.lock);
+	free(export->rows.keys);
+	free(export->rows.stats);
+	free(export->buf.iov);
+	free(export);
+}
+
+/*
+ * Like traceeval_export(), but the caller only takes a snapshot of the
+ * stats of the results. One background thread formats the snapshot
+ * while another writes what it formatted, so the caller can go back to
+ * updating @teval in the meantime. At most 3 * EXPORT_FLUSH chunks are
+ * in memory at any time, as the formatting waits for the writes.
+ *
+ * @teval must not be freed, and string keys must stay valid, until the
+ * export is reaped with traceeval_export_wait().
+ */
+struct traceeval_export *
+traceeval_export_start(struct traceeval *teval, int fd,
+		       enum traceeval_export_format format)
+{
+	struct traceeval_export *export;
+
+	if (format != TRACEEVAL_EXPORT_CSV && format != TRACEEVAL_EXPORT_BINARY)
+		return NULL;
+
+	if (trace_eval_get_results(teval) < 0)
+		return NULL;
+
+	export = calloc(1, sizeof(*export));
+	if (!export)
+		return NULL;
+
+	export->teval = teval;
+	export->format = format;
+	export->buf.queue = &export->queue;
+	export->queue.fd = fd;
+	pthread_mutex_init(&export->queue.lock, NULL);
+	pthread_cond_init(&export->queue.cond, NULL);
+
+	if (snapshot_rows(teval, &export->rows) < 0)
+		goto fail;
+
+	if (pthread_create(&export->write_thread, NULL, write_thread, &export->queue))
+		goto fail;
+
+	if (pthread_create(&export->format_thread, NULL, format_thread, export)) {
+		pthread_mutex_lock(&export->queue.lock);
+		export->queue.done = true;
+		pthread_cond_broadcast(&export->queue.cond);
+		pthread_mutex_unlock(&export->queue.lock);
+		pthread_join(export->write_thread, NULL);
+		goto fail;
+	}
+
+	return export;
+ fail:
+	free_export(export);
+	return NULL;
+}
+
+/* Wait for the writes of @export to finish, returns 0 if all succeeded */
+int traceeval_export_wait(struct traceeval_export *export)
+{
+	int ret;
+
+	if (!export)
+		return -1;
+
+	pthread_join(export->format_thread, NULL);
+	pthread_join(export->write_thread, NULL);
+	ret = export->buf.ret < 0 || export->queue.ret < 0 ? -1 : 0;
+
+	free_export(export);
+	return ret;
+}
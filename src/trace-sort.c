@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2022 Google Inc, Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "traceeval-local.h"
+
+typedef int (*sort_cmp_func)(const void *, const void *, void *);
+
+struct sort_run {
+	char			*base;
+	size_t			nmemb;
+};
+
+struct sort_work {
+	/* the chunk to sort, or the left run to merge */
+	struct sort_run		a;
+	/* the right run to merge, empty when sorting */
+	struct sort_run		b;
+	char			*dst;
+	size_t			size;
+	sort_cmp_func		cmp;
+	void			*arg;
+	pthread_t		thread;
+	bool			started;
+};
+
+static void merge_runs(struct sort_work *work)
+{
+	char *a = work->a.base, *a_end = a + work->a.nmemb * work->size;
+	char *b = work->b.base, *b_end = b + work->b.nmemb * work->size;
+	char *dst = work->dst;
+	size_t size = work->size;
+
+	/* Take from the left run on ties to keep the merge stable */
+	while (a < a_end && b < b_end) {
+		if (work->cmp(b, a, work->arg) < 0) {
+			memcpy(dst, b, size);
+			b += size;
+		} else {
+			memcpy(dst, a, size);
+			a += size;
+		}
+		dst += size;
+	}
+	memcpy(dst, a, a_end - a);
+	dst += a_end - a;
+	memcpy(dst, b, b_end - b);
+}
+
+static void *sort_thread(void *data)
+{
+	struct sort_work *work = data;
+
+	if (work->b.nmemb)
+		merge_runs(work);
+	else
+		qsort_r(work->a.base, work->a.nmemb, work->size, work->cmp, work->arg);
+	return NULL;
+}
+
+/* Run all of @works, the first one on the calling thread */
+static void run_works(struct sort_work *works, int nr)
+{
+	int i;
+
+	for (i = 1; i < nr; i++) {
+		works[i].started = !pthread_create(&works[i].thread, NULL,
+						   sort_thread, &works[i]);
+		if (!works[i].started)
+			sort_thread(&works[i]);
+	}
+
+	sort_thread(&works[0]);
+
+	for (i = 1; i < nr; i++) {
+		if (works[i].started)
+			pthread_join(works[i].thread, NULL);
+	}
+}
+
+/*
+ * Return the number of threads to use for @nr_threads: zero, or any
+ * count above the number of online CPUs, is one per online CPU. Returns
+ * one if the CPUs can not be counted.
+ */
+int trace_eval_threads(int nr_threads)
+{
+	long nr_cpus;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_cpus < 2)
+		return 1;
+
+	if (nr_threads <= 0 || nr_threads > nr_cpus)
+		nr_threads = nr_cpus;
+
+	return nr_threads;
+}
+
+/*
+ * Sort @base with a merge sort over @nr_threads threads: each thread sorts
+ * a chunk with qsort_r(), then the runs are merged pairwise, in parallel,
+ * until one is left. The merges are stable, so the result only depends
+ * on @cmp and not on the number of threads as long as @cmp is a total
+ * order. A @nr_threads of zero or above the number of online CPUs uses
+ * one thread per online CPU. Falls back to qsort_r() if the CPUs can
+ * not be counted or memory can not be allocated.
+ */
+void trace_eval_sort(void *base, size_t nmemb, size_t size,
+		     int (*cmp)(const void *, const void *, void *), void *arg,
+		     int nr_threads)
+{
+	struct sort_run *runs = NULL;
+	struct sort_work *works = NULL;
+	char *src = base, *dst, *tmp = NULL;
+	size_t chunk, start;
+	int nr_runs, nr, i;
+
+	nr_threads = trace_eval_threads(nr_threads);
+	if (nr_threads > nmemb / 2)
+		nr_threads = nmemb / 2;
+
+	if (nr_threads < 2)
+		goto serial;
+
+	tmp = malloc(nmemb * size);
+	runs = calloc(nr_threads, sizeof(*runs));
+	works = calloc(nr_threads, sizeof(*works));
+	if (!tmp || !runs || !works)
+		goto serial;
+
+	chunk = (nmemb + nr_threads - 1) / nr_threads;
+	for (i = 0, start = 0; i < nr_threads && start < nmemb; i++, start += chunk) {
+		runs[i].base = src + start * size;
+		runs[i].nmemb = nmemb - start < chunk ? nmemb - start : chunk;
+		works[i].a = runs[i];
+		works[i].size = size;
+		works[i].cmp = cmp;
+		works[i].arg = arg;
+	}
+	nr_runs = i;
+
+	run_works(works, nr_runs);
+
+	dst = tmp;
+	while (nr_runs > 1) {
+		memset(works, 0, sizeof(*works) * nr_threads);
+
+		for (nr = 0, i = 0; i < nr_runs; i += 2, nr++) {
+			works[nr].a = runs[i];
+			if (i + 1 < nr_runs)
+				works[nr].b = runs[i + 1];
+			works[nr].dst = dst + (runs[i].base - src);
+			works[nr].size = size;
+			works[nr].cmp = cmp;
+			works[nr].arg = arg;
+		}
+
+		/* A lone run at the end is only copied over */
+		for (i = 0; i < nr; i++) {
+			if (!works[i].b.nmemb) {
+				memcpy(works[i].dst, works[i].a.base, works[i].a.nmemb * size);
+				works[i].a.nmemb = 0;
+			}
+		}
+
+		run_works(works, nr);
+
+		for (i = 0; i < nr; i++) {
+			runs[i].base = works[i].dst;
+			runs[i].nmemb = (runs[2 * i].nmemb) +
+				(2 * i + 1 < nr_runs ? runs[2 * i + 1].nmemb : 0);
+		}
+		nr_runs = nr;
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (src != base)
+		memcpy(base, src, nmemb * size);
+
+	/* One of src and dst is the scratch buffer */
+	free(src == base ? dst : src);
+	free(runs);
+	free(works);
+	return;
+ serial:
+	free(tmp);
+	free(runs);
+	free(works);
+	qsort_r(base, nmemb, size, cmp, arg);
+}
@@ -0,0 +1,392 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2022 Google Inc, Steven Rostedt <rostedt@goodmis.org>
+ */
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <traceeval-tracecmd.h>
+
+#include "traceeval-local.h"
+
+/* Events handed to the thread of a partition at a time */
+#define INGEST_CHUNK		4096
+#define INGEST_STRING_HASH	1024
+
+struct ingest_event {
+	unsigned long long		ts;
+	enum traceeval_tracecmd_op	op;
+	int				metric;
+	struct traceeval_key		keys[];
+};
+
+struct ingest_string {
+	struct ingest_string		*next;
+	char				str[];
+};
+
+struct ingest {
+	struct traceeval		*teval;
+	size_t				event_size;
+	int				nr_parts;
+	struct ingest_part		*parts;
+};
+
+/*
+ * The keys of a partition are applied to its table by its own thread.
+ * The reader fills one chunk of events while the thread applies
+ * another, and at most one more waits in between, so at most three
+ * chunks per partition are ever allocated.
+ */
+struct ingest_part {
+	struct ingest			*ingest;
+	struct traceeval		*teval;
+	/* Only used by the reader */
+	char				*fill;
+	size_t				nr_fill;
+	/* Protected by lock */
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	char				*ready;
+	size_t				nr_ready;
+	char				*spare;
+	bool				done;
+	int				ret;
+	pthread_t			thread;
+	bool				started;
+};
+
+struct traceeval_tracecmd_events {
+	struct ingest			*ingest;
+	struct ingest_string		*strings[INGEST_STRING_HASH];
+};
+
+/*
+ * The strings of the keys must outlive the record they came from. Each
+ * distinct one is kept once until the end of the ingest.
+ */
+static const char *intern_string(struct traceeval_tracecmd_events *events, const char *str)
+{
+	struct ingest_string *istr;
+	unsigned int hash = 0;
+	size_t len;
+
+	for (len = 0; str[len]; len++)
+		hash = hash * 31 + (unsigned char)str[len];
+	hash %= INGEST_STRING_HASH;
+
+	for (istr = events->strings[hash]; istr; istr = istr->next) {
+		if (strcmp(istr->str, str) == 0)
+			return istr->str;
+	}
+
+	istr = malloc(sizeof(*istr) + len + 1);
+	if (!istr)
+		return NULL;
+	memcpy(istr->str, str, len + 1);
+	istr->next = events->strings[hash];
+	events->strings[hash] = istr;
+	return istr->str;
+}
+
+static int apply_event(struct traceeval *teval, struct ingest_event *event)
+{
+	switch (event->op) {
+	case TRACEEVAL_TRACECMD_START:
+		return traceeval_n_metric_start(teval, event->keys, event->metric, event->ts);
+	case TRACEEVAL_TRACECMD_STOP:
+		return traceeval_n_metric_stop(teval, event->keys, event->metric, event->ts);
+	case TRACEEVAL_TRACECMD_CONTINUE:
+		return traceeval_n_metric_continue(teval, event->keys, event->metric, event->ts);
+	case TRACEEVAL_TRACECMD_START_NESTED:
+		return traceeval_n_metric_start_nested(teval, event->keys, event->metric,
+						       event->ts);
+	}
+	return -1;
+}
+
+static void *apply_thread(void *arg)
+{
+	struct ingest_part *ipart = arg;
+	size_t event_size = ipart->ingest->event_size;
+	char *chunk;
+	size_t nr;
+	size_t i;
+	int ret = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&ipart->lock);
+		while (!ipart->ready && !ipart->done)
+			pthread_cond_wait(&ipart->cond, &ipart->lock);
+		chunk = ipart->ready;
+		nr = ipart->nr_ready;
+		ipart->ready = NULL;
+		pthread_cond_broadcast(&ipart->cond);
+		pthread_mutex_unlock(&ipart->lock);
+
+		if (!chunk)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			/* A stop without a start returns 1 and is not an error */
+			ret = apply_event(ipart->teval,
+					  (struct ingest_event *)(chunk + event_size * i));
+			if (ret < 0)
+				break;
+		}
+
+		pthread_mutex_lock(&ipart->lock);
+		if (ret < 0) {
+			ipart->ret = -1;
+			pthread_cond_broadcast(&ipart->cond);
+		}
+		if (!ipart->spare) {
+			ipart->spare = chunk;
+			chunk = NULL;
+		}
+		pthread_mutex_unlock(&ipart->lock);
+
+		free(chunk);
+		if (ret < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Hand the events filled for @ipart to its thread, and get a chunk to refill */
+static int flush_part(struct ingest_part *ipart)
+{
+	char *chunk;
+
+	pthread_mutex_lock(&ipart->lock);
+	while (ipart->ready && !ipart->ret)
+		pthread_cond_wait(&ipart->cond, &ipart->lock);
+	if (ipart->ret) {
+		pthread_mutex_unlock(&ipart->lock);
+		return -1;
+	}
+	ipart->ready = ipart->fill;
+	ipart->nr_ready = ipart->nr_fill;
+	chunk = ipart->spare;
+	ipart->spare = NULL;
+	pthread_cond_broadcast(&ipart->cond);
+	pthread_mutex_unlock(&ipart->lock);
+
+	ipart->fill = chunk;
+	ipart->nr_fill = 0;
+	return 0;
+}
+
+/*
+ * Called by the function passed to traceeval_tracecmd_ingest() to
+ * queue a start or stop of @metric for @keys at @ts. The events are
+ * applied to the table in the order they are added, which is the time
+ * order of the records of all the CPUs, so an interval may start and
+ * stop on different CPUs. String keys may point into the record.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int traceeval_tracecmd_add(struct traceeval_tracecmd_events *events,
+			   enum traceeval_tracecmd_op op,
+			   const struct traceeval_key *keys, int metric,
+			   unsigned long long ts)
+{
+	struct ingest *ingest = events->ingest;
+	struct traceeval *teval = ingest->teval;
+	struct ingest_event *event;
+	struct ingest_part *ipart;
+	int hash;
+	int i;
+
+	if (metric < 0 || metric >= teval->nr_metrics)
+		return -1;
+
+	/* The table is only read while ingesting, so it can hash for the parts */
+	hash = trace_eval_hash(teval, keys);
+	if (hash < 0)
+		return -1;
+
+	ipart = &ingest->parts[hash % ingest->nr_parts];
+	if (!ipart->fill) {
+		ipart->fill = malloc(ingest->event_size * INGEST_CHUNK);
+		if (!ipart->fill)
+			return -1;
+	}
+
+	event = (struct ingest_event *)(ipart->fill + ingest->event_size * ipart->nr_fill);
+	event->ts = ts;
+	event->op = op;
+	event->metric = metric;
+
+	for (i = 0; i < teval->array.nr_keys; i++) {
+		event->keys[i] = keys[i];
+		if (keys[i].type != TRACEEVAL_TYPE_STRING)
+			continue;
+		event->keys[i].string = intern_string(events, keys[i].string);
+		if (!event->keys[i].string)
+			return -1;
+	}
+
+	if (++ipart->nr_fill == INGEST_CHUNK)
+		return flush_part(ipart);
+	return 0;
+}
+
+static void free_strings(struct traceeval_tracecmd_events *events)
+{
+	struct ingest_string *istr;
+	int i;
+
+	for (i = 0; i < INGEST_STRING_HASH; i++) {
+		while (events->strings[i]) {
+			istr = events->strings[i];
+			events->strings[i] = istr->next;
+			free(istr);
+		}
+	}
+}
+
+/* Read the records of all the CPUs in time order and pass them to @func */
+static int read_records(struct tracecmd_input *handle,
+			struct traceeval_tracecmd_events *events,
+			traceeval_tracecmd_func func, void *data)
+{
+	struct tep_handle *tep = tracecmd_get_tep(handle);
+	struct tep_record *record;
+	int ret;
+	int cpu;
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		ret = func(events, tep, record, cpu, data);
+		tracecmd_free_record(record);
+		if (ret < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the trace.dat @file, and account the intervals found in it in
+ * @teval. The records of all the CPU buffers are read in time order,
+ * and @func is called for each of them from the calling thread. As it
+ * is called for one record at a time, @func may use tep as it likes,
+ * for instance to look up the event of the record. It queues the
+ * starts and stops it extracts from the record with
+ * traceeval_tracecmd_add().
+ *
+ * The events are split by key over a thread per online CPU, each of
+ * which applies its share to a table of its own while the file is
+ * still being read. As a key only ever lands in one of them, every
+ * start and stop of a key is applied in time order, whichever CPU it
+ * came from. Those tables are merged into @teval at the end. Intervals
+ * still started at the end of the file are not carried over, nor are
+ * intervals started in @teval before the call.
+ *
+ * The records and the tep handle do not outlive the call, so @teval
+ * copies string keys into its instances from the first call on, and
+ * keeps doing so for later inserts. Its existing instances are kept as
+ * they are.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int traceeval_tracecmd_ingest(struct traceeval *teval, const char *file,
+			      traceeval_tracecmd_func func, void *data)
+{
+	struct traceeval_tracecmd_events *events;
+	struct tracecmd_input *handle;
+	struct ingest_part *ipart;
+	struct ingest ingest;
+	int ret = -1;
+	int i;
+
+	memset(&ingest, 0, sizeof(ingest));
+	ingest.teval = teval;
+	ingest.event_size = sizeof(struct ingest_event) +
+		sizeof(struct traceeval_key) * teval->array.nr_keys;
+
+	events = calloc(1, sizeof(*events));
+	if (!events)
+		return -1;
+	events->ingest = &ingest;
+
+	handle = tracecmd_open(file, 0);
+	if (!handle)
+		goto out_free;
+
+	teval->copy_strings = true;
+
+	ingest.nr_parts = trace_eval_threads(0);
+	ingest.parts = calloc(ingest.nr_parts, sizeof(*ingest.parts));
+	if (!ingest.parts)
+		goto out_close;
+
+	for (i = 0; i < ingest.nr_parts; i++) {
+		ipart = &ingest.parts[i];
+		ipart->ingest = &ingest;
+		pthread_mutex_init(&ipart->lock, NULL);
+		pthread_cond_init(&ipart->cond, NULL);
+	}
+
+	ret = 0;
+
+	for (i = 0; i < ingest.nr_parts; i++) {
+		ipart = &ingest.parts[i];
+		ipart->teval = trace_eval_alloc_like(teval);
+		if (!ipart->teval ||
+		    pthread_create(&ipart->thread, NULL, apply_thread, ipart)) {
+			ret = -1;
+			break;
+		}
+		ipart->started = true;
+	}
+
+	if (!ret)
+		ret = read_records(handle, events, func, data);
+
+	for (i = 0; i < ingest.nr_parts && !ret; i++) {
+		ipart = &ingest.parts[i];
+		if (ipart->nr_fill)
+			ret = flush_part(ipart);
+	}
+
+	for (i = 0; i < ingest.nr_parts; i++) {
+		ipart = &ingest.parts[i];
+		if (!ipart->started)
+			continue;
+		pthread_mutex_lock(&ipart->lock);
+		ipart->done = true;
+		/* Do not apply what is left on error */
+		if (ret < 0 && ipart->ready) {
+			free(ipart->ready);
+			ipart->ready = NULL;
+		}
+		pthread_cond_broadcast(&ipart->cond);
+		pthread_mutex_unlock(&ipart->lock);
+		pthread_join(ipart->thread, NULL);
+		if (ipart->ret < 0)
+			ret = -1;
+	}
+
+	for (i = 0; i < ingest.nr_parts && !ret; i++) {
+		if (traceeval_merge(teval, ingest.parts[i].teval) < 0)
+			ret = -1;
+	}
+
+	for (i = 0; i < ingest.nr_parts; i++) {
+		ipart = &ingest.parts[i];
+		traceeval_free(ipart->teval);
+		free(ipart->fill);
+		free(ipart->ready);
+		free(ipart->spare);
+		pthread_cond_destroy(&ipart->cond);
+		pthread_mutex_destroy(&ipart->lock);
+	}
+	free(ingest.parts);
+ out_close:
+	tracecmd_close(handle);
+ out_free:
+	free_strings(events);
+	free(events);
+	return ret;
+}